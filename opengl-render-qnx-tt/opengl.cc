@@ -32,6 +32,9 @@
 #include <sys/sysctl.h>
 #include <sys/param.h>
 #include <netinet/tcp_var.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/wait.h>
 
 
 #ifndef TCP_USER_TIMEOUT
@@ -154,51 +157,167 @@ static EGLenum checkErrorEGL(const char* msg)
 	return error;
 }
 
+// Display manager commands
+// dmdt switches display 0 (VC) between our display table and the stock one.
 struct Command {
 	const char* command;
 	const char* error_message;
 };
 
-// CODE FROM HERE IS THE SAME FOR WINDOWS OR QNX
-void execute_initial_commands() {
-	struct Command commands[] = {
-		{"/eso/bin/apps/dmdt dc 99 3", "Create new display table with context 3 failed with error"},
-		{"/eso/bin/apps/dmdt sc 0 99", "Set display 4 (VC) to display table 99 failed with error"}
-	};
-	size_t num_commands = sizeof(commands) / sizeof(commands[0]);
+#define DISPLAY_UNKNOWN 0
+#define DISPLAY_VNC     1 // table 99 with the VNC context on the VC
+#define DISPLAY_STOCK   2 // back to the stock table 16
 
-	for (size_t i = 0; i < num_commands; ++i) {
-		const char* command = commands[i].command;
-		const char* error_message = commands[i].error_message;
-		printf("Executing '%s'\n", command);
+static const Command displayVncCommands[] = {
+	{"/eso/bin/apps/dmdt dc 99 3", "Create new display table with context 3 failed with error"},
+	{"/eso/bin/apps/dmdt sc 0 99", "Set display 4 (VC) to display table 99 failed with error"}
+};
+static const Command displayStockCommands[] = {
+	{"/eso/bin/apps/dmdt sc 0 16", "Set display 0 (VC) to display table 70 failed with error"}
+};
 
-		// Execute the command
-		int ret = system(command);
-		if (ret != 0) {
-			fprintf(stderr, "%s: %d\n", error_message, ret);
-		}
+// The stock HMI may take display 0 back behind our back, so the render loop
+// re-issues our table this often while it draws.
+#define DISPLAY_REASSERT_SECONDS 10
+
+// Display executor. Everything from here to display_shutdown is kept
+// identical in opengl-render-qnx and opengl-render-qnx-tt, apart from
+// indentation; change both copies together. The commands run on a
+// background thread through posix_spawn, without a shell, so neither
+// reconnecting nor rendering waits for a child process. Only the newest
+// requested state counts: requests made while dmdt runs collapse into one,
+// and a state that is already applied is not issued again unless the
+// request forces it. A failed switch is retried on the next request.
+struct DisplayExecutor {
+	pthread_t thread;
+	int started;
+	int wanted;           // DISPLAY_* asked for last
+	int applied;          // DISPLAY_* the last successful run switched to
+	int forced;           // issue wanted even if it is applied already
+	unsigned requests;
+	unsigned served;      // requests the executor has picked up
+	int stop;             // finish what was requested, then end
+};
+
+static DisplayExecutor displayExecutor;
+static pthread_mutex_t displayLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t displayWake = PTHREAD_COND_INITIALIZER; // new request or stop
+
+extern char** environ;
+
+// Runs one command line without a shell. Returns its exit status, -1 if it
+// could not be started or did not exit normally.
+static int run_command(const char* command)
+{
+	char line[256];
+	char* argv[16];
+	char* save = NULL;
+	int argc = 0;
+	strncpy(line, command, sizeof(line) - 1);
+	line[sizeof(line) - 1] = 0;
+	for (char* tok = strtok_r(line, " ", &save); tok && argc < 15; tok = strtok_r(NULL, " ", &save)) {
+		argv[argc++] = tok;
 	}
+	argv[argc] = NULL;
+	if (argc == 0) return -1;
+
+	pid_t pid;
+	int err = posix_spawn(&pid, argv[0], NULL, NULL, argv, environ);
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	int status = 0;
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) return -1;
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
 }
 
-void execute_final_commands() {
-	struct Command commands[] = {
-		{"/eso/bin/apps/dmdt sc 0 16", "Set display 0 (VC) to display table 70 failed with error"}
-	};
-	size_t num_commands = sizeof(commands) / sizeof(commands[0]);
-
+// Returns 0 when every command of the state succeeded.
+static int display_apply(int state)
+{
+	const Command* commands = displayStockCommands;
+	size_t num_commands = sizeof(displayStockCommands) / sizeof(displayStockCommands[0]);
+	if (state == DISPLAY_VNC) {
+		commands = displayVncCommands;
+		num_commands = sizeof(displayVncCommands) / sizeof(displayVncCommands[0]);
+	}
+	int failed = 0;
 	for (size_t i = 0; i < num_commands; ++i) {
-		const char* command = commands[i].command;
-		const char* error_message = commands[i].error_message;
-		printf("Executing '%s'\n", command);
-
-		// Execute the command
-		int ret = system(command);
+		printf("Executing '%s'\n", commands[i].command);
+		int ret = run_command(commands[i].command);
 		if (ret != 0) {
-			fprintf(stderr, "%s: %d\n", error_message, ret);
+			fprintf(stderr, "%s: %d\n", commands[i].error_message, ret);
+			failed = 1;
 		}
 	}
+	return failed ? -1 : 0;
+}
+
+static void* display_executor_main(void* arg)
+{
+	DisplayExecutor* ex = (DisplayExecutor*)arg;
+	pthread_mutex_lock(&displayLock);
+	for (;;) {
+		while (ex->served == ex->requests && !ex->stop) pthread_cond_wait(&displayWake, &displayLock);
+		if (ex->served == ex->requests) break; // stop, nothing left to do
+		ex->served = ex->requests;
+		if (ex->wanted == ex->applied && !ex->forced) continue;
+		int state = ex->wanted;
+		ex->forced = 0;
+		ex->applied = DISPLAY_UNKNOWN; // half switched until every command went through
+		pthread_mutex_unlock(&displayLock);
+
+		int ret = display_apply(state);
+
+		pthread_mutex_lock(&displayLock);
+		if (ret == 0) ex->applied = state;
+	}
+	pthread_mutex_unlock(&displayLock);
+	return NULL;
+}
+
+// Asks for a display state and returns at once; force re-issues it even if
+// it is applied already. Without the executor thread the commands run here.
+static void display_request(int state, int force)
+{
+	DisplayExecutor* ex = &displayExecutor;
+	pthread_mutex_lock(&displayLock);
+	if (!ex->started) {
+		ex->started = pthread_create(&ex->thread, NULL, display_executor_main, ex) == 0 ? 1 : -1;
+		if (ex->started < 0) perror("pthread_create display executor");
+	}
+	if (ex->started < 0) {
+		pthread_mutex_unlock(&displayLock);
+		display_apply(state);
+		return;
+	}
+	ex->wanted = state;
+	ex->forced |= force;
+	ex->requests++;
+	pthread_cond_broadcast(&displayWake);
+	pthread_mutex_unlock(&displayLock);
 }
 
+// Carries out the requests made so far and ends the executor thread; later
+// requests run on the caller's thread.
+static void display_shutdown()
+{
+	DisplayExecutor* ex = &displayExecutor;
+	pthread_mutex_lock(&displayLock);
+	int started = ex->started;
+	ex->stop = 1;
+	pthread_cond_broadcast(&displayWake);
+	pthread_mutex_unlock(&displayLock);
+	if (started <= 0) return;
+	pthread_join(ex->thread, NULL);
+	pthread_mutex_lock(&displayLock);
+	ex->started = -1;
+	pthread_mutex_unlock(&displayLock);
+}
+
+// CODE FROM HERE IS THE SAME FOR WINDOWS OR QNX
 std::string readPersistanceData(const std::string& position) {
     std::string command = "";
 #ifdef _WIN32
@@ -628,7 +747,7 @@ int main(int argc, char* argv[]) {
 	while (true)
 	{
 		printf("Main loop executed \n");
-		execute_final_commands();
+		display_request(DISPLAY_STOCK, 0);
 		int sockfd;
 	    fd_set write_fds;
 	    int result;
@@ -782,7 +901,7 @@ int main(int argc, char* argv[]) {
 		if (sockfd != NULL)
 		{
 			// we have connection so swap to different view
-			execute_initial_commands();
+			display_request(DISPLAY_VNC, 0);
 		}
 
 		// Receive server initialization message
@@ -915,7 +1034,7 @@ int main(int argc, char* argv[]) {
 
 
 		int frameCount = 0;
-		int switchToMap = 0;
+		time_t lastReassert = time(NULL);
 		double fps = 0.0;
 		time_t startTime = time(NULL);
 
@@ -1007,23 +1126,23 @@ int main(int argc, char* argv[]) {
             //print_string(-333, 150, readPersistanceData("s:2001:101").c_str(), 1, 1, 1, 64); // persistance data
 
 			eglSwapBuffers(eglDisplay, eglSurface);
-			switchToMap++;
-			if(switchToMap > 25)
+			if (time(NULL) - lastReassert >= DISPLAY_REASSERT_SECONDS)
 			{
-				switchToMap = 0;
-				execute_initial_commands();
+				lastReassert = time(NULL);
+				display_request(DISPLAY_VNC, 1); // the stock HMI may have switched back
 			}
 			free(framebufferUpdate); // Free the dynamically allocated memory
 		}
 		glDeleteTextures(1, &textureID);
-		execute_final_commands();
+		display_request(DISPLAY_STOCK, 0);
 	}
 	// Cleanup
 	eglSwapBuffers(eglDisplay, eglSurface);
 	eglDestroySurface(eglDisplay, eglSurface);
 	eglDestroyContext(eglDisplay, eglContext);
 	eglTerminate(eglDisplay);
-	execute_final_commands();
+	display_request(DISPLAY_STOCK, 0);
+	display_shutdown();
 
 	return EXIT_SUCCESS;
 }
@@ -7,6 +7,7 @@
 #include <string.h>
 #include <sys/keycodes.h>
 #include <time.h>
+#include <math.h>
 #include "stb_easyfont.hh"
 #include <regex.h>
 #include <GLES2/gl2.h>
@@ -28,6 +29,11 @@
 #include <sys/time.h>
 #include <stdint.h>
 #include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
 
 #include <netinet/tcp.h>
 #include <fcntl.h>
@@ -41,12 +47,13 @@
 
 // ---------------- Timing (C++98-friendly) ----------------
 struct FrameTimings {
-    double recv_ms;
+    double wait_ms; // blocked on the first byte of the message (server had nothing yet)
+    double recv_ms; // reading the rest of it
     double inflate_ms;
     double parse_ms;
     double texture_upload_ms;
     double total_frame_ms;
-    FrameTimings() : recv_ms(0.0), inflate_ms(0.0), parse_ms(0.0), texture_upload_ms(0.0), total_frame_ms(0.0) {}
+    FrameTimings() : wait_ms(0.0), recv_ms(0.0), inflate_ms(0.0), parse_ms(0.0), texture_upload_ms(0.0), total_frame_ms(0.0) {}
 };
 
 static uint64_t now_us()
@@ -97,6 +104,8 @@ static int recv_exact(int sockfd, void* buf, size_t len, FrameTimings* timings)
 
 // ---------------- GLES setup ----------------
 GLuint programObject;
+GLuint programObjectYCbCr;
+GLuint programObjectPalette;
 GLuint programObjectTextRender;
 EGLDisplay eglDisplay;
 EGLConfig eglConfig;
@@ -124,6 +133,41 @@ const char* fragmentShaderSource =
     "    gl_FragColor = texture2D(texture, v_texCoord);\n"
     "}\n";
 
+// 8bpp canvas: the texture holds colour indices, looked up in a 256x1 table.
+const char* fragmentShaderSourcePalette =
+    "precision mediump float;\n"
+    "varying vec2 v_texCoord;\n"
+    "uniform sampler2D texture;\n"
+    "uniform sampler2D palette;\n"
+    "void main()\n"
+    "{\n"
+    "    float index = texture2D(texture, v_texCoord).r;\n"
+    "    gl_FragColor = texture2D(palette, vec2((index * 255.0 + 0.5) / 256.0, 0.5));\n"
+    "}\n";
+
+// Same, but areas last sent as JPEG come from the Y/Cb/Cr planes (mask = 1)
+// and are converted here, so the CPU never expands them to RGBA.
+const char* fragmentShaderSourceYCbCr =
+    "precision mediump float;\n"
+    "varying vec2 v_texCoord;\n"
+    "uniform sampler2D texture;\n"
+    "uniform sampler2D texY;\n"
+    "uniform sampler2D texCb;\n"
+    "uniform sampler2D texCr;\n"
+    "uniform sampler2D texMask;\n"
+    "void main()\n"
+    "{\n"
+    "    vec4 rgba = texture2D(texture, v_texCoord);\n"
+    "    float y  = texture2D(texY,  v_texCoord).r;\n"
+    "    float cb = texture2D(texCb, v_texCoord).r - 0.5;\n"
+    "    float cr = texture2D(texCr, v_texCoord).r - 0.5;\n"
+    "    vec3 jpeg = vec3(y + 1.402 * cr,\n"
+    "                     y - 0.344136 * cb - 0.714136 * cr,\n"
+    "                     y + 1.772 * cb);\n"
+    "    float m = texture2D(texMask, v_texCoord).r;\n"
+    "    gl_FragColor = vec4(mix(rgba.rgb, jpeg, m), rgba.a);\n"
+    "}\n";
+
 // Text Rendering shaders
 const char* vertexShaderSourceText =
     "attribute vec2 position;    \n"
@@ -170,13 +214,65 @@ GLfloat backgroundColor[4] = {0.0f, 0.0f, 0.0f, 1.0f}; // RGBA default black
 
 // Constants for VNC protocol
 const char* PROTOCOL_VERSION = "RFB 003.003\n";
-const char FRAMEBUFFER_UPDATE_REQUEST[] = { 3, 0, 0, 0, 0, 0, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF };
+const char FRAMEBUFFER_UPDATE_REQUEST = 3;
 const char CLIENT_INIT[] = { 1 };
-const char ZLIB_ENCODING[] = { 2, 0, 0, 2, 0, 0, 0, 6, 0, 0, 0, 0 };
+const char SET_ENCODINGS = 2;
+const char SET_PIXEL_FORMAT = 0;
+const unsigned char ENABLE_CONTINUOUS_UPDATES = 150;
+const unsigned char CLIENT_FENCE = 248;
+const unsigned char SET_SCALE = 8; // UltraVNC, also understood by libvncserver (droidVNC-NG)
+
+// Server->client message types
+const unsigned char MSG_FRAMEBUFFER_UPDATE = 0;
+const unsigned char MSG_SET_COLOUR_MAP_ENTRIES = 1;
+const unsigned char MSG_BELL = 2;
+const unsigned char MSG_SERVER_CUT_TEXT = 3;
+const unsigned char MSG_END_OF_CONTINUOUS_UPDATES = 150;
+const unsigned char MSG_SERVER_FENCE = 248;
+
+// Fence flags
+const uint32_t FENCE_BLOCK_BEFORE = 1u << 0;
+const uint32_t FENCE_BLOCK_AFTER  = 1u << 1;
+const uint32_t FENCE_SYNC_NEXT    = 1u << 2;
+const uint32_t FENCE_REQUEST      = 1u << 31;
+
+// RFB encoding numbers
+const int ENCODING_RAW = 0;
+const int ENCODING_COPYRECT = 1;
+const int ENCODING_HEXTILE = 5;
+const int ENCODING_ZLIB = 6;
+const int ENCODING_TIGHT = 7;
+const int ENCODING_TRLE = 15;
+const int ENCODING_ZRLE = 16;
+const int ENCODING_QUALITY_LEVEL_0 = -32; // -32..-23 = Tight JPEG quality 0..9
+const int ENCODING_COMPRESS_LEVEL_0 = -256; // -256..-247 = zlib/Tight effort 0..9
+const int ENCODING_DESKTOP_SIZE = -223;
+const int ENCODING_CURSOR = -239;
+const int ENCODING_POINTER_POS = -232;
+const int ENCODING_EXTENDED_DESKTOP_SIZE = -308;
+const int ENCODING_FENCE = -312;
+const int ENCODING_CONTINUOUS_UPDATES = -313;
 
 // SETUP
 int windowWidth  = 800;
 int windowHeight = 480;
+int incrementalUpdates = 1; // 0 = always ask for the whole screen
+int pixelFormatBits = 32;   // 32, 16 (RGB565) or 8 (BGR233)
+int continuousUpdates = 1;  // let servers that support it push updates unasked
+int requestDepth = 1;       // FramebufferUpdateRequests kept outstanding in request mode
+int compressLevel = -1;     // 0-9, -1 = server default (then targetFrameMs leaves it alone)
+int targetFrameMs = 100;    // adapt compress/quality level towards this, 0 = off
+int serverScale = 0;        // SetScale divisor for the server, -1 = fit the window, 0 = never send
+int decodeThreads = 0;      // decode pool workers, 0 = one per CPU core
+int statsInterval = 0;      // ms between network stats lines, 0 = off
+
+// Encodings offered in SetEncodings, most preferred first
+#define MAX_ENCODINGS 16
+int preferredEncodings[MAX_ENCODINGS] = { ENCODING_COPYRECT, ENCODING_TIGHT, ENCODING_ZRLE, ENCODING_ZLIB, ENCODING_HEXTILE,
+                                          ENCODING_DESKTOP_SIZE, ENCODING_EXTENDED_DESKTOP_SIZE,
+                                          ENCODING_CURSOR, ENCODING_POINTER_POS };
+int preferredEncodingCount = 9;
+int jpegQuality = 6; // Tight JPEG quality 0-9, -1 = lossless only
 
 const char* VNC_SERVER_IP_ADDRESS = "10.173.189.62";
 const int   VNC_SERVER_PORT       = 5900;
@@ -212,325 +308,4821 @@ static EGLenum checkErrorEGL(const char* msg) {
     return error;
 }
 
+// ---------------- Display manager commands ----------------
+// dmdt switches display 4 (VC) between our display table and the stock one.
 struct Command {
     const char* command;
     const char* error_message;
 };
 
-void execute_initial_commands() {
-    struct Command commands[] = {
-        { "/eso/bin/apps/dmdt dc 70 3",  "Create new display table with context 3 failed with error" },
-        { "/eso/bin/apps/dmdt sc 4 70",  "Set display 4 (VC) to display table 99 failed with error" }
-    };
-    size_t num_commands = sizeof(commands) / sizeof(commands[0]);
+#define DISPLAY_UNKNOWN 0
+#define DISPLAY_VNC     1 // our table with the VNC context on the VC
+#define DISPLAY_STOCK   2 // table 70 back on the stock context
+
+static const Command displayVncCommands[] = {
+    { "/eso/bin/apps/dmdt dc 70 3",  "Create new display table with context 3 failed with error" },
+    { "/eso/bin/apps/dmdt sc 4 70",  "Set display 4 (VC) to display table 99 failed with error" }
+};
+static const Command displayStockCommands[] = {
+    { "/eso/bin/apps/dmdt dc 70 33", "Create new display table with context 3 failed with error" },
+    { "/eso/bin/apps/dmdt sc 4 70",  "Set display 4 (VC) to display table 99 failed with error" }
+};
+
+// Display executor. Everything from here to display_shutdown is kept
+// identical in opengl-render-qnx and opengl-render-qnx-tt, apart from
+// indentation; change both copies together. The commands run on a
+// background thread through posix_spawn, without a shell, so neither
+// reconnecting nor rendering waits for a child process. Only the newest
+// requested state counts: requests made while dmdt runs collapse into one,
+// and a state that is already applied is not issued again unless the
+// request forces it. A failed switch is retried on the next request.
+struct DisplayExecutor {
+    pthread_t thread;
+    int started;
+    int wanted;           // DISPLAY_* asked for last
+    int applied;          // DISPLAY_* the last successful run switched to
+    int forced;           // issue wanted even if it is applied already
+    unsigned requests;
+    unsigned served;      // requests the executor has picked up
+    int stop;             // finish what was requested, then end
+};
+
+static DisplayExecutor displayExecutor;
+static pthread_mutex_t displayLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t displayWake = PTHREAD_COND_INITIALIZER; // new request or stop
+
+extern char** environ;
+
+// Runs one command line without a shell. Returns its exit status, -1 if it
+// could not be started or did not exit normally.
+static int run_command(const char* command)
+{
+    char line[256];
+    char* argv[16];
+    char* save = NULL;
+    int argc = 0;
+    strncpy(line, command, sizeof(line) - 1);
+    line[sizeof(line) - 1] = 0;
+    for (char* tok = strtok_r(line, " ", &save); tok && argc < 15; tok = strtok_r(NULL, " ", &save)) {
+        argv[argc++] = tok;
+    }
+    argv[argc] = NULL;
+    if (argc == 0) return -1;
+
+    pid_t pid;
+    int err = posix_spawn(&pid, argv[0], NULL, NULL, argv, environ);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
 
+// Returns 0 when every command of the state succeeded.
+static int display_apply(int state)
+{
+    const Command* commands = displayStockCommands;
+    size_t num_commands = sizeof(displayStockCommands) / sizeof(displayStockCommands[0]);
+    if (state == DISPLAY_VNC) {
+        commands = displayVncCommands;
+        num_commands = sizeof(displayVncCommands) / sizeof(displayVncCommands[0]);
+    }
+    int failed = 0;
     for (size_t i = 0; i < num_commands; ++i) {
         printf("Executing '%s'\n", commands[i].command);
-        int ret = system(commands[i].command);
-        if (ret != 0) fprintf(stderr, "%s: %d\n", commands[i].error_message, ret);
+        int ret = run_command(commands[i].command);
+        if (ret != 0) {
+            fprintf(stderr, "%s: %d\n", commands[i].error_message, ret);
+            failed = 1;
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+static void* display_executor_main(void* arg)
+{
+    DisplayExecutor* ex = (DisplayExecutor*)arg;
+    pthread_mutex_lock(&displayLock);
+    for (;;) {
+        while (ex->served == ex->requests && !ex->stop) pthread_cond_wait(&displayWake, &displayLock);
+        if (ex->served == ex->requests) break; // stop, nothing left to do
+        ex->served = ex->requests;
+        if (ex->wanted == ex->applied && !ex->forced) continue;
+        int state = ex->wanted;
+        ex->forced = 0;
+        ex->applied = DISPLAY_UNKNOWN; // half switched until every command went through
+        pthread_mutex_unlock(&displayLock);
+
+        int ret = display_apply(state);
+
+        pthread_mutex_lock(&displayLock);
+        if (ret == 0) ex->applied = state;
+    }
+    pthread_mutex_unlock(&displayLock);
+    return NULL;
+}
+
+// Asks for a display state and returns at once; force re-issues it even if
+// it is applied already. Without the executor thread the commands run here.
+static void display_request(int state, int force)
+{
+    DisplayExecutor* ex = &displayExecutor;
+    pthread_mutex_lock(&displayLock);
+    if (!ex->started) {
+        ex->started = pthread_create(&ex->thread, NULL, display_executor_main, ex) == 0 ? 1 : -1;
+        if (ex->started < 0) perror("pthread_create display executor");
+    }
+    if (ex->started < 0) {
+        pthread_mutex_unlock(&displayLock);
+        display_apply(state);
+        return;
+    }
+    ex->wanted = state;
+    ex->forced |= force;
+    ex->requests++;
+    pthread_cond_broadcast(&displayWake);
+    pthread_mutex_unlock(&displayLock);
+}
+
+// Carries out the requests made so far and ends the executor thread; later
+// requests run on the caller's thread.
+static void display_shutdown()
+{
+    DisplayExecutor* ex = &displayExecutor;
+    pthread_mutex_lock(&displayLock);
+    int started = ex->started;
+    ex->stop = 1;
+    pthread_cond_broadcast(&displayWake);
+    pthread_mutex_unlock(&displayLock);
+    if (started <= 0) return;
+    pthread_join(ex->thread, NULL);
+    pthread_mutex_lock(&displayLock);
+    ex->started = -1;
+    pthread_mutex_unlock(&displayLock);
+}
+
+int16_t byteArrayToInt16(const char* byteArray) {
+    return (int16_t)(((unsigned char)byteArray[0] << 8) | (unsigned char)byteArray[1]);
+}
+
+void int16ToByteArray(int value, char* byteArray) {
+    byteArray[0] = (char)((value >> 8) & 0xFF);
+    byteArray[1] = (char)(value & 0xFF);
+}
+
+int32_t byteArrayToInt32(const char* byteArray) {
+    return (int32_t)(
+        ((uint32_t)(unsigned char)byteArray[0] << 24) |
+        ((uint32_t)(unsigned char)byteArray[1] << 16) |
+        ((uint32_t)(unsigned char)byteArray[2] <<  8) |
+        ((uint32_t)(unsigned char)byteArray[3]      )
+    );
+}
+
+// ---------------- GL init ----------------
+static void compile_check(GLuint shader, const char* tag)
+{
+    GLint ok = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char infoLog[512];
+        glGetShaderInfoLog(shader, 512, NULL, infoLog);
+        printf("%s compile failed: %s\n", tag, infoLog);
+    }
+}
+
+static void link_check(GLuint prog, const char* tag)
+{
+    GLint ok = GL_FALSE;
+    glGetProgramiv(prog, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        char infoLog[512];
+        glGetProgramInfoLog(prog, 512, NULL, infoLog);
+        printf("%s link failed: %s\n", tag, infoLog);
+    }
+}
+
+void Init() {
+    GLuint vs = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vs, 1, &vertexShaderSource, NULL);
+    glCompileShader(vs);
+    compile_check(vs, "VNC VS");
+
+    GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fs, 1, &fragmentShaderSource, NULL);
+    glCompileShader(fs);
+    compile_check(fs, "VNC FS");
+
+    GLuint fsY = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fsY, 1, &fragmentShaderSourceYCbCr, NULL);
+    glCompileShader(fsY);
+    compile_check(fsY, "VNC YCbCr FS");
+
+    GLuint fsP = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fsP, 1, &fragmentShaderSourcePalette, NULL);
+    glCompileShader(fsP);
+    compile_check(fsP, "VNC palette FS");
+
+    GLuint vsT = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vsT, 1, &vertexShaderSourceText, NULL);
+    glCompileShader(vsT);
+    compile_check(vsT, "TXT VS");
+
+    GLuint fsT = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fsT, 1, &fragmentShaderSourceText, NULL);
+    glCompileShader(fsT);
+    compile_check(fsT, "TXT FS");
+
+    programObject = glCreateProgram();
+    glAttachShader(programObject, vs);
+    glAttachShader(programObject, fs);
+    glLinkProgram(programObject);
+    link_check(programObject, "VNC PROG");
+
+    programObjectYCbCr = glCreateProgram();
+    glAttachShader(programObjectYCbCr, vs);
+    glAttachShader(programObjectYCbCr, fsY);
+    glLinkProgram(programObjectYCbCr);
+    link_check(programObjectYCbCr, "VNC YCbCr PROG");
+
+    // texture units are fixed: 0 = canvas, 1-4 = JPEG planes and mask, 5 = palette
+    glUseProgram(programObjectYCbCr);
+    glUniform1i(glGetUniformLocation(programObjectYCbCr, "texture"), 0);
+    glUniform1i(glGetUniformLocation(programObjectYCbCr, "texY"), 1);
+    glUniform1i(glGetUniformLocation(programObjectYCbCr, "texCb"), 2);
+    glUniform1i(glGetUniformLocation(programObjectYCbCr, "texCr"), 3);
+    glUniform1i(glGetUniformLocation(programObjectYCbCr, "texMask"), 4);
+
+    programObjectPalette = glCreateProgram();
+    glAttachShader(programObjectPalette, vs);
+    glAttachShader(programObjectPalette, fsP);
+    glLinkProgram(programObjectPalette);
+    link_check(programObjectPalette, "VNC palette PROG");
+
+    glUseProgram(programObjectPalette);
+    glUniform1i(glGetUniformLocation(programObjectPalette, "texture"), 0);
+    glUniform1i(glGetUniformLocation(programObjectPalette, "palette"), 5);
+
+    programObjectTextRender = glCreateProgram();
+    glAttachShader(programObjectTextRender, vsT);
+    glAttachShader(programObjectTextRender, fsT);
+    glLinkProgram(programObjectTextRender);
+    link_check(programObjectTextRender, "TXT PROG");
+
+	// Set clear color to black
+	glClearColor(
+    backgroundColor[0],
+    backgroundColor[1],
+    backgroundColor[2],
+    backgroundColor[3]);
+}
+
+// ---------------- Text render (unchanged logic, minor fix for attrib program) ----------------
+void print_string(float x, float y, const char* text, float r, float g, float b, float size) {
+    (void)r; (void)g; (void)b; // shader is constant color in this example
+    char inputBuffer[2000] = { 0 };
+    GLfloat triangleBuffer[2000] = { 0 };
+    stb_easy_font_print(0, 0, (char*)text, NULL, inputBuffer, sizeof(inputBuffer));
+
+    float ndcMovementX = (2.0f * x) / windowWidth;
+    float ndcMovementY = (2.0f * y) / windowHeight;
+
+    int triangleIndex = 0;
+    for (int i = 0; i < (int)(sizeof(inputBuffer) / sizeof(GLfloat)); i += 8) {
+        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[i * sizeof(GLfloat)]) / size + ndcMovementX;
+        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 1) * sizeof(GLfloat)]) / size * -1 + ndcMovementY;
+        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 2) * sizeof(GLfloat)]) / size + ndcMovementX;
+        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 3) * sizeof(GLfloat)]) / size * -1 + ndcMovementY;
+        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 4) * sizeof(GLfloat)]) / size + ndcMovementX;
+        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 5) * sizeof(GLfloat)]) / size * -1 + ndcMovementY;
+
+        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[i * sizeof(GLfloat)]) / size + ndcMovementX;
+        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 1) * sizeof(GLfloat)]) / size * -1 + ndcMovementY;
+        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 4) * sizeof(GLfloat)]) / size + ndcMovementX;
+        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 5) * sizeof(GLfloat)]) / size * -1 + ndcMovementY;
+        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 6) * sizeof(GLfloat)]) / size + ndcMovementX;
+        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 7) * sizeof(GLfloat)]) / size * -1 + ndcMovementY;
+    }
+
+    glUseProgram(programObjectTextRender);
+
+    GLuint vbo;
+    glGenBuffers(1, &vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(triangleBuffer), triangleBuffer, GL_STATIC_DRAW);
+
+    // FIX: query attribute from the TEXT program, not the VNC program
+    GLint positionAttribute = glGetAttribLocation(programObjectTextRender, "position");
+    glEnableVertexAttribArray(positionAttribute);
+    glVertexAttribPointer(positionAttribute, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+
+    glDrawArrays(GL_TRIANGLES, 0, triangleIndex);
+
+    glDeleteBuffers(1, &vbo);
+}
+
+// ---------------- Config file helpers (unchanged) ----------------
+void parseLineArray(char *line, const char *key, GLfloat *dest, int count) {
+    if (strncmp(line, key, strlen(key)) == 0) {
+        char *values = strchr(line, '=');
+        if (values) {
+            values++;
+            for (int i = 0; i < count; i++) dest[i] = strtof(values, &values);
+        }
+    }
+}
+void parseLineInt(char *line, const char *key, int *dest) {
+    if (strncmp(line, key, strlen(key)) == 0) {
+        char *value = strchr(line, '=');
+        if (value) *dest = atoi(value + 1);
+    }
+}
+void parseLineIntArray(char *line, const char *key, int *dest, int maxCount, int *count) {
+    if (strncmp(line, key, strlen(key)) == 0) {
+        char *values = strchr(line, '=');
+        if (values) {
+            values++;
+            int n = 0;
+            while (n < maxCount) {
+                char *next;
+                long v = strtol(values, &next, 10);
+                if (next == values) break;
+                dest[n++] = (int)v;
+                values = next;
+            }
+            if (n > 0) *count = n;
+        }
+    }
+}
+void loadConfig(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        printf("Config file not found. Using defaults.\n");
+        return;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        parseLineArray(line, "landscapeVertices", landscapeVertices, 12);
+        parseLineArray(line, "portraitVertices", portraitVertices, 12);
+        parseLineArray(line, "landscapeTexCoords", landscapeTexCoords, 8);
+        parseLineArray(line, "portraitTexCoords", portraitTexCoords, 8);
+        parseLineArray(line, "backgroundColor", backgroundColor, 4);
+        parseLineInt(line, "windowWidth", &windowWidth);
+        parseLineInt(line, "windowHeight", &windowHeight);
+        parseLineInt(line, "incrementalUpdates", &incrementalUpdates);
+        parseLineIntArray(line, "encodings", preferredEncodings, MAX_ENCODINGS, &preferredEncodingCount);
+        parseLineInt(line, "jpegQuality", &jpegQuality);
+        parseLineInt(line, "pixelFormat", &pixelFormatBits);
+        parseLineInt(line, "continuousUpdates", &continuousUpdates);
+        parseLineInt(line, "requestDepth", &requestDepth);
+        parseLineInt(line, "compressLevel", &compressLevel);
+        parseLineInt(line, "targetFrameMs", &targetFrameMs);
+        parseLineInt(line, "serverScale", &serverScale);
+        parseLineInt(line, "decodeThreads", &decodeThreads);
+        parseLineInt(line, "statsInterval", &statsInterval);
+    }
+    fclose(file);
+}
+void printArray(const char *label, GLfloat *array, int count, int elementsPerLine) {
+    printf("%s:\n", label);
+    for (int i = 0; i < count; i++) {
+        printf("%f ", array[i]);
+        if ((i + 1) % elementsPerLine == 0) printf("\n");
+    }
+    printf("\n");
+}
+
+// ---------------- Pixel format ----------------
+// PIXEL_FORMAT from ServerInit: bpp(1), depth(1), big-endian(1), true-colour(1),
+// red/green/blue max(2 each), red/green/blue shift(1 each), padding(3)
+struct PixelFormat {
+    int bitsPerPixel;
+    int depth;
+    int bigEndian;
+    int trueColour;
+    int redMax, greenMax, blueMax;
+    int redShift, greenShift, blueShift;
+    PixelFormat() : bitsPerPixel(32), depth(24), bigEndian(0), trueColour(1),
+                    redMax(255), greenMax(255), blueMax(255),
+                    redShift(0), greenShift(8), blueShift(16) {}
+};
+
+static int host_big_endian()
+{
+    const uint16_t one = 1;
+    return *(const unsigned char*)&one == 0;
+}
+
+// Formats offered through the pixelFormat config key, all in host byte order
+// so the canvas goes to GL unchanged: 32 = R,G,B,X bytes (GL_RGBA),
+// 16 = RGB565 (GL_UNSIGNED_SHORT_5_6_5), 8 = BGR233 (palette texture).
+static int client_pixel_format(int bits, PixelFormat* pf)
+{
+    *pf = PixelFormat();
+    pf->bigEndian = host_big_endian();
+    switch (bits) {
+        case 32:
+            if (pf->bigEndian) {
+                pf->redShift = 24;
+                pf->greenShift = 16;
+                pf->blueShift = 8;
+            }
+            return 0;
+        case 16:
+            pf->bitsPerPixel = 16;
+            pf->depth = 16;
+            pf->redMax = 31;   pf->redShift = 11;
+            pf->greenMax = 63; pf->greenShift = 5;
+            pf->blueMax = 31;  pf->blueShift = 0;
+            return 0;
+        case 8:
+            pf->bitsPerPixel = 8;
+            pf->depth = 8;
+            pf->redMax = 7;   pf->redShift = 0;
+            pf->greenMax = 7; pf->greenShift = 3;
+            pf->blueMax = 3;  pf->blueShift = 6;
+            return 0;
+    }
+    return -1;
+}
+
+static void parse_pixel_format(const char* buf, PixelFormat* pf)
+{
+    pf->bitsPerPixel = (unsigned char)buf[0];
+    pf->depth        = (unsigned char)buf[1];
+    pf->bigEndian    = buf[2] != 0;
+    pf->trueColour   = buf[3] != 0;
+    pf->redMax       = (uint16_t)byteArrayToInt16(buf + 4);
+    pf->greenMax     = (uint16_t)byteArrayToInt16(buf + 6);
+    pf->blueMax      = (uint16_t)byteArrayToInt16(buf + 8);
+    pf->redShift     = (unsigned char)buf[10];
+    pf->greenShift   = (unsigned char)buf[11];
+    pf->blueShift    = (unsigned char)buf[12];
+}
+
+static int send_set_pixel_format(int sockfd, const PixelFormat* pf)
+{
+    // type(1), pad(3), PIXEL_FORMAT(16)
+    char msg[20];
+    memset(msg, 0, sizeof(msg));
+    msg[0] = SET_PIXEL_FORMAT;
+    msg[4] = (char)pf->bitsPerPixel;
+    msg[5] = (char)pf->depth;
+    msg[6] = (char)pf->bigEndian;
+    msg[7] = (char)pf->trueColour;
+    int16ToByteArray(pf->redMax, msg + 8);
+    int16ToByteArray(pf->greenMax, msg + 10);
+    int16ToByteArray(pf->blueMax, msg + 12);
+    msg[14] = (char)pf->redShift;
+    msg[15] = (char)pf->greenShift;
+    msg[16] = (char)pf->blueShift;
+    return send(sockfd, msg, sizeof(msg), 0) == (ssize_t)sizeof(msg) ? 0 : -1;
+}
+
+// Compressed pixel (CPIXEL) used by ZRLE/TRLE: a 32bpp true-colour pixel whose
+// colour bits fit in three bytes is sent as just those three bytes.
+struct CPixelFormat {
+    int size;   // bytes per CPIXEL on the wire
+    int offset; // where those bytes go inside a canvas pixel
+};
+
+static CPixelFormat cpixel_format(const PixelFormat* pf)
+{
+    CPixelFormat cf;
+    cf.size = pf->bitsPerPixel / 8;
+    cf.offset = 0;
+    if (pf->bitsPerPixel == 32 && pf->trueColour && pf->depth <= 24) {
+        uint32_t mask = ((uint32_t)pf->redMax << pf->redShift) |
+                        ((uint32_t)pf->greenMax << pf->greenShift) |
+                        ((uint32_t)pf->blueMax << pf->blueShift);
+        if ((mask & 0xFF000000u) == 0) {
+            cf.size = 3;
+            cf.offset = pf->bigEndian ? 1 : 0;
+        } else if ((mask & 0x000000FFu) == 0) {
+            cf.size = 3;
+            cf.offset = pf->bigEndian ? 0 : 1;
+        }
+    }
+    return cf;
+}
+
+template <typename P>
+static inline P cpixel_load(const unsigned char* b, const CPixelFormat* cf)
+{
+    P p;
+    if (cf->size == (int)sizeof(P)) {
+        memcpy(&p, b, sizeof(P));
+        return p;
     }
+    unsigned char px[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+    memcpy(px + cf->offset, b, (size_t)cf->size);
+    memcpy(&p, px, sizeof(P));
+    return p;
+}
+
+// ---------------- Client-side canvas ----------------
+#define MAX_DIRTY_RECTS 64
+
+struct DirtyRect {
+    int x, y, w, h;
+};
+
+// Areas of the canvas changed since the last texture upload. Overflowing the
+// list simply falls back to a whole-canvas upload.
+struct DirtyRegion {
+    DirtyRect rects[MAX_DIRTY_RECTS];
+    int count;
+    int full;
+    DirtyRegion() : count(0), full(0) {}
+};
+
+// Persistent copy of the server framebuffer, sized from ServerInit. Every rect
+// is written at its own x/y, so the server only has to send what changed.
+struct Canvas {
+    char* pixels;
+    int width;
+    int height;
+    int bytesPerPixel;
+    int stride;
+    PixelFormat format;
+    DirtyRegion dirty;
+    struct CanvasPlanes* planes; // allocated by the first JPEG rect
+    int resized;                 // DesktopSize changed it; texture needs new storage
+    DirtyRect visible;           // part the quad samples; requests and uploads stay inside
+    struct CanvasCursor* cursor; // allocated by the first Cursor rect
+    Canvas() : pixels(NULL), width(0), height(0), bytesPerPixel(4), stride(0), planes(NULL), resized(0),
+               cursor(NULL) {}
+};
+
+// Tight JPEG rects are kept as decoded YCbCr: Y at canvas size, Cb/Cr at half
+// size in each direction. mask is 255 where the planes hold the current image
+// and 0 where pixels does; the shader picks per texel.
+struct CanvasPlanes {
+    unsigned char* y;
+    unsigned char* cb;
+    unsigned char* cr;
+    unsigned char* mask;
+    int chromaWidth;
+    int chromaHeight;
+    DirtyRegion dirty;     // Y/Cb/Cr, in canvas coordinates
+    DirtyRegion maskDirty;
+};
+
+// Pointer image from the Cursor pseudo-encoding, drawn over the canvas by the
+// GPU; the server leaves it out of the framebuffer. x/y come from PointerPos.
+struct CanvasCursor {
+    unsigned char* rgba; // width * height, alpha from the cursor bitmask
+    size_t rgbaSize;
+    int width;
+    int height;
+    int hotX, hotY;
+    int x, y;
+    int positioned;      // a PointerPos arrived; until then there is nowhere to draw it
+    int imageDirty;      // rgba changed since the last upload
+};
+
+static void dirty_add(DirtyRegion* d, int x, int y, int w, int h)
+{
+    if (d->full || w <= 0 || h <= 0) return;
+    if (d->count == MAX_DIRTY_RECTS) {
+        d->full = 1;
+        return;
+    }
+    d->rects[d->count].x = x;
+    d->rects[d->count].y = y;
+    d->rects[d->count].w = w;
+    d->rects[d->count].h = h;
+    d->count++;
+}
+
+// Sets the mask over a rect to value; returns 1 if anything changed.
+static int mask_fill(unsigned char* mask, int maskStride, int x, int y, int w, int h, unsigned char value)
+{
+    int changed = 0;
+    for (int row = 0; row < h; row++) {
+        unsigned char* m = mask + (size_t)(y + row) * maskStride + x;
+        int i = 0;
+        while (i < w && m[i] == value) i++;
+        if (i < w) {
+            memset(m + i, value, (size_t)(w - i));
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+// pixels changed over this rect; it is no longer covered by the JPEG planes
+static void canvas_mark_dirty(Canvas* canvas, int x, int y, int w, int h)
+{
+    dirty_add(&canvas->dirty, x, y, w, h);
+    CanvasPlanes* pl = canvas->planes;
+    if (pl && w > 0 && h > 0 && mask_fill(pl->mask, canvas->width, x, y, w, h, 0)) {
+        dirty_add(&pl->maskDirty, x, y, w, h);
+    }
+}
+
+// Y/Cb/Cr changed over this rect and now take precedence over pixels.
+static void canvas_mark_planes_dirty(Canvas* canvas, int x, int y, int w, int h)
+{
+    CanvasPlanes* pl = canvas->planes;
+    dirty_add(&pl->dirty, x, y, w, h);
+    if (mask_fill(pl->mask, canvas->width, x, y, w, h, 255)) {
+        dirty_add(&pl->maskDirty, x, y, w, h);
+    }
+}
+
+static int canvas_planes_init(Canvas* canvas)
+{
+    if (canvas->planes) return 0;
+    CanvasPlanes* pl = new CanvasPlanes();
+    size_t lumaSize = (size_t)canvas->width * (size_t)canvas->height;
+    pl->chromaWidth = (canvas->width + 1) / 2;
+    pl->chromaHeight = (canvas->height + 1) / 2;
+    size_t chromaSize = (size_t)pl->chromaWidth * (size_t)pl->chromaHeight;
+    pl->y = (unsigned char*)calloc(lumaSize, 1);
+    pl->mask = (unsigned char*)calloc(lumaSize, 1);
+    pl->cb = (unsigned char*)malloc(chromaSize);
+    pl->cr = (unsigned char*)malloc(chromaSize);
+    if (!pl->y || !pl->mask || !pl->cb || !pl->cr) {
+        free(pl->y); free(pl->mask); free(pl->cb); free(pl->cr);
+        delete pl;
+        return -1;
+    }
+    memset(pl->cb, 128, chromaSize);
+    memset(pl->cr, 128, chromaSize);
+    pl->dirty.full = 1;     // fresh textures have undefined contents
+    pl->maskDirty.full = 1;
+    canvas->planes = pl;
+    return 0;
+}
+
+static void canvas_planes_free(Canvas* canvas)
+{
+    CanvasPlanes* pl = canvas->planes;
+    if (!pl) return;
+    free(pl->y); free(pl->mask); free(pl->cb); free(pl->cr);
+    delete pl;
+    canvas->planes = NULL;
+}
+
+// The configured texcoords usually crop the phone screen (status bar, side
+// strip). Their bounding box, plus one texel for bilinear filtering, is the
+// only part of the canvas that can ever reach the display.
+static void canvas_update_visible(Canvas* canvas)
+{
+    const GLfloat* tc = canvas->width > canvas->height ? landscapeTexCoords : portraitTexCoords;
+    float u0 = 1.0f, u1 = 0.0f, v0 = 1.0f, v1 = 0.0f;
+    for (int i = 0; i < 4; i++) {
+        float u = tc[i * 2] < 0.0f ? 0.0f : (tc[i * 2] > 1.0f ? 1.0f : tc[i * 2]);
+        float v = tc[i * 2 + 1] < 0.0f ? 0.0f : (tc[i * 2 + 1] > 1.0f ? 1.0f : tc[i * 2 + 1]);
+        if (u < u0) u0 = u;
+        if (u > u1) u1 = u;
+        if (v < v0) v0 = v;
+        if (v > v1) v1 = v;
+    }
+    int x0 = (int)floorf(u0 * canvas->width) - 1;
+    int y0 = (int)floorf(v0 * canvas->height) - 1;
+    int x1 = (int)ceilf(u1 * canvas->width) + 1;
+    int y1 = (int)ceilf(v1 * canvas->height) + 1;
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > canvas->width) x1 = canvas->width;
+    if (y1 > canvas->height) y1 = canvas->height;
+    if (x1 <= x0 || y1 <= y0) {
+        x0 = y0 = 0;
+        x1 = canvas->width;
+        y1 = canvas->height;
+    }
+    canvas->visible.x = x0;
+    canvas->visible.y = y0;
+    canvas->visible.w = x1 - x0;
+    canvas->visible.h = y1 - y0;
+}
+
+static int canvas_init(Canvas* canvas, int width, int height)
+{
+    if (width <= 0 || height <= 0) return -1;
+    canvas->pixels = (char*)calloc((size_t)width * (size_t)height, (size_t)canvas->bytesPerPixel);
+    if (!canvas->pixels) return -1;
+    canvas->width = width;
+    canvas->height = height;
+    canvas->stride = width * canvas->bytesPerPixel;
+    canvas->dirty.count = 0;
+    canvas->dirty.full = 1;
+    canvas_update_visible(canvas);
+    return 0;
+}
+
+// DesktopSize / ExtendedDesktopSize: the old contents mean nothing at the new
+// size, so the canvas starts blank and the server resends everything.
+static int canvas_resize(Canvas* canvas, int width, int height)
+{
+    if (width <= 0 || height <= 0) return -1;
+    char* pixels = (char*)calloc((size_t)width * (size_t)height, (size_t)canvas->bytesPerPixel);
+    if (!pixels) return -1;
+    canvas_planes_free(canvas);
+    free(canvas->pixels);
+    canvas->pixels = pixels;
+    canvas->width = width;
+    canvas->height = height;
+    canvas->stride = width * canvas->bytesPerPixel;
+    canvas->dirty.count = 0;
+    canvas->dirty.full = 1;
+    canvas->resized = 1;
+    canvas_update_visible(canvas);
+    return 0;
+}
+
+static CanvasCursor* canvas_cursor(Canvas* canvas)
+{
+    if (!canvas->cursor) canvas->cursor = (CanvasCursor*)calloc(1, sizeof(CanvasCursor));
+    return canvas->cursor;
+}
+
+// Cursor rect payload: w*h pixels in the client format, then a bitmask of
+// (w + 7) / 8 bytes per row, MSB first, 1 = opaque. w or h of 0 hides it.
+static int canvas_set_cursor(Canvas* canvas, int hotX, int hotY, int w, int h, const unsigned char* data)
+{
+    CanvasCursor* cur = canvas_cursor(canvas);
+    if (!cur) return -1;
+    size_t count = (size_t)w * (size_t)h;
+    if (count * 4 > cur->rgbaSize) {
+        unsigned char* tmp = (unsigned char*)realloc(cur->rgba, count * 4);
+        if (!tmp) return -1;
+        cur->rgba = tmp;
+        cur->rgbaSize = count * 4;
+    }
+
+    const PixelFormat* pf = &canvas->format;
+    const int bpp = canvas->bytesPerPixel;
+    const unsigned char* mask = data + count * (size_t)bpp;
+    const int maskStride = (w + 7) / 8;
+    unsigned char* out = cur->rgba;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++, data += bpp, out += 4) {
+            uint32_t v = *data; // the client format is in host byte order
+            if (bpp == 4) {
+                uint32_t p;
+                memcpy(&p, data, 4);
+                v = p;
+            } else if (bpp == 2) {
+                uint16_t p;
+                memcpy(&p, data, 2);
+                v = p;
+            }
+            out[0] = (unsigned char)(((v >> pf->redShift) & pf->redMax) * 255 / pf->redMax);
+            out[1] = (unsigned char)(((v >> pf->greenShift) & pf->greenMax) * 255 / pf->greenMax);
+            out[2] = (unsigned char)(((v >> pf->blueShift) & pf->blueMax) * 255 / pf->blueMax);
+            out[3] = (mask[y * maskStride + (x >> 3)] >> (7 - (x & 7))) & 1 ? 255 : 0;
+        }
+    }
+    cur->width = w;
+    cur->height = h;
+    cur->hotX = hotX;
+    cur->hotY = hotY;
+    cur->imageDirty = 1;
+    return 0;
+}
+
+static void canvas_free(Canvas* canvas)
+{
+    canvas_planes_free(canvas);
+    if (canvas->cursor) {
+        free(canvas->cursor->rgba);
+        free(canvas->cursor);
+        canvas->cursor = NULL;
+    }
+    free(canvas->pixels);
+    canvas->pixels = NULL;
+    canvas->width = canvas->height = canvas->stride = 0;
+}
+
+// copy a tightly packed w*h block into the canvas at x/y (clipped to the canvas)
+static void canvas_put_rect(Canvas* canvas, int x, int y, int w, int h, const char* src)
+{
+    int srcStride = w * canvas->bytesPerPixel;
+    if (x < 0 || y < 0 || x >= canvas->width || y >= canvas->height) return;
+    if (x + w > canvas->width)  w = canvas->width - x;
+    if (y + h > canvas->height) h = canvas->height - y;
+    if (w <= 0 || h <= 0) return;
+
+    canvas_mark_dirty(canvas, x, y, w, h);
+
+    size_t rowBytes = (size_t)w * (size_t)canvas->bytesPerPixel;
+    char* dst = canvas->pixels + (size_t)y * canvas->stride + (size_t)x * canvas->bytesPerPixel;
+    if (x == 0 && w == canvas->width && srcStride == canvas->stride) {
+        memcpy(dst, src, rowBytes * (size_t)h);
+        return;
+    }
+    for (int row = 0; row < h; row++) {
+        memcpy(dst, src, rowBytes);
+        dst += canvas->stride;
+        src += srcStride;
+    }
+}
+
+// ---------------- Texture upload (dirty rects) ----------------
+// The texture is allocated once per session with texture_alloc(); afterwards
+// only the dirty parts of the canvas are pushed with glTexSubImage2D. GLES2
+// has no GL_UNPACK_ROW_LENGTH, so a rect narrower than the canvas is packed
+// into a scratch buffer first, while a full-width band of rows can be uploaded
+// straight from the canvas. Rects that sit close together vertically are
+// merged into one band whenever that moves fewer bytes than packing them.
+#define UPLOAD_CALL_COST_PIXELS 4096 // rough per-call driver overhead
+
+// One texture's worth of CPU memory: the canvas itself or one JPEG plane.
+struct TexturePlane {
+    const char* pixels;
+    int width;
+    int height;
+    int stride;
+    int bytesPerPixel;
+    GLenum format;
+    GLenum type;
+};
+
+struct TextureUploader {
+    char* scratch;
+    size_t scratchSize;
+    GLuint planeTextures[4]; // Y, Cb, Cr, mask on units 1-4, created on demand
+    GLuint paletteTexture;   // 8bpp colour lookup on unit 5
+    GLuint cursorTexture;    // bound on unit 0 only while the pointer is drawn
+    TextureUploader() : scratch(NULL), scratchSize(0), paletteTexture(0), cursorTexture(0)
+    {
+        memset(planeTextures, 0, sizeof(planeTextures));
+    }
+};
+
+// The canvas goes to GL in its wire format: 32bpp as RGBA bytes, RGB565 as
+// GL_UNSIGNED_SHORT_5_6_5 and 8bpp as raw colour indices.
+static TexturePlane canvas_plane(const Canvas* canvas)
+{
+    TexturePlane p;
+    p.pixels = canvas->pixels;
+    p.width = canvas->width;
+    p.height = canvas->height;
+    p.stride = canvas->stride;
+    p.bytesPerPixel = canvas->bytesPerPixel;
+    p.format = GL_RGBA;
+    p.type = GL_UNSIGNED_BYTE;
+    if (canvas->bytesPerPixel == 2) {
+        p.format = GL_RGB;
+        p.type = GL_UNSIGNED_SHORT_5_6_5;
+    } else if (canvas->bytesPerPixel == 1) {
+        p.format = GL_LUMINANCE;
+    }
+    return p;
+}
+
+// 256x1 RGBA table turning an 8bpp true-colour index back into RGB.
+static void palette_texture_alloc(const Canvas* canvas, TextureUploader* up)
+{
+    const PixelFormat* pf = &canvas->format;
+    unsigned char lut[256 * 4];
+    for (int i = 0; i < 256; i++) {
+        lut[i * 4 + 0] = (unsigned char)(((i >> pf->redShift) & pf->redMax) * 255 / pf->redMax);
+        lut[i * 4 + 1] = (unsigned char)(((i >> pf->greenShift) & pf->greenMax) * 255 / pf->greenMax);
+        lut[i * 4 + 2] = (unsigned char)(((i >> pf->blueShift) & pf->blueMax) * 255 / pf->blueMax);
+        lut[i * 4 + 3] = 255;
+    }
+    glGenTextures(1, &up->paletteTexture);
+    glActiveTexture(GL_TEXTURE5);
+    glBindTexture(GL_TEXTURE_2D, up->paletteTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 256, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, lut);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// Allocates the canvas texture (bound on unit 0) for the session, and again
+// after a resize; the JPEG plane textures are then recreated on demand.
+static void texture_alloc(const Canvas* canvas, TextureUploader* up)
+{
+    TexturePlane p = canvas_plane(canvas);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // 565 / 8bpp / luminance rows are not 4-byte aligned
+    if (up->planeTextures[0]) {
+        glDeleteTextures(4, up->planeTextures);
+        memset(up->planeTextures, 0, sizeof(up->planeTextures));
+    }
+    if (canvas->bytesPerPixel == 1 && !up->paletteTexture) {
+        // indices must not be interpolated; the palette shader filters nothing
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        palette_texture_alloc(canvas, up);
+    }
+    glTexImage2D(GL_TEXTURE_2D, 0, p.format, canvas->width, canvas->height,
+                 0, p.format, p.type, NULL);
+}
+
+static long rect_upload_cost(const TexturePlane* plane, const DirtyRect* r)
+{
+    long pixels = (long)r->w * (long)r->h;
+    if (r->w != plane->width) pixels *= 2; // pack + upload
+    return pixels + UPLOAD_CALL_COST_PIXELS;
+}
+
+static void upload_band(const TexturePlane* plane, int y0, int y1)
+{
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y0, plane->width, y1 - y0,
+                    plane->format, plane->type,
+                    plane->pixels + (size_t)y0 * plane->stride);
+}
+
+static void upload_rect(const TexturePlane* plane, TextureUploader* up, const DirtyRect* r)
+{
+    if (r->w == plane->width) {
+        upload_band(plane, r->y, r->y + r->h);
+        return;
+    }
+
+    size_t rowBytes = (size_t)r->w * (size_t)plane->bytesPerPixel;
+    size_t needed = rowBytes * (size_t)r->h;
+    if (needed > up->scratchSize) {
+        char* tmp = (char*)realloc(up->scratch, needed);
+        if (!tmp) {
+            // no room to pack the rect; the full-width band still reaches the texture
+            upload_band(plane, r->y, r->y + r->h);
+            return;
+        }
+        up->scratch = tmp;
+        up->scratchSize = needed;
+    }
+
+    const char* src = plane->pixels + (size_t)r->y * plane->stride + (size_t)r->x * plane->bytesPerPixel;
+    char* dst = up->scratch;
+    for (int row = 0; row < r->h; row++) {
+        memcpy(dst, src, rowBytes);
+        dst += rowBytes;
+        src += plane->stride;
+    }
+    glTexSubImage2D(GL_TEXTURE_2D, 0, r->x, r->y, r->w, r->h,
+                    plane->format, plane->type, up->scratch);
+}
+
+static int rect_intersect(DirtyRect* r, const DirtyRect* clip)
+{
+    int x0 = r->x > clip->x ? r->x : clip->x;
+    int y0 = r->y > clip->y ? r->y : clip->y;
+    int x1 = r->x + r->w < clip->x + clip->w ? r->x + r->w : clip->x + clip->w;
+    int y1 = r->y + r->h < clip->y + clip->h ? r->y + r->h : clip->y + clip->h;
+    if (x1 <= x0 || y1 <= y0) return 0;
+    r->x = x0;
+    r->y = y0;
+    r->w = x1 - x0;
+    r->h = y1 - y0;
+    return 1;
+}
+
+// canvas coordinates -> half-resolution chroma coordinates, rounded outwards
+static void rect_to_chroma(DirtyRect* r)
+{
+    int x1 = (r->x + r->w + 1) / 2;
+    int y1 = (r->y + r->h + 1) / 2;
+    r->x /= 2;
+    r->y /= 2;
+    r->w = x1 - r->x;
+    r->h = y1 - r->y;
+}
+
+// Uploads the part of a plane's dirty region inside clip to the bound texture
+// and clears the region. Texels outside clip are never sampled.
+static void texture_upload_region(const TexturePlane* plane, DirtyRegion* d, const DirtyRect* clip,
+                                  TextureUploader* up)
+{
+    if (d->full) {
+        d->full = 0;
+        if (clip->w == plane->width && clip->h == plane->height) {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, plane->width, plane->height,
+                            plane->format, plane->type, plane->pixels);
+            d->count = 0;
+            return;
+        }
+        d->rects[0] = *clip;
+        d->count = 1;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < d->count; i++) {
+        DirtyRect r = d->rects[i];
+        if (rect_intersect(&r, clip)) d->rects[kept++] = r;
+    }
+    d->count = kept;
+
+    // sort by top edge (at most MAX_DIRTY_RECTS entries)
+    for (int i = 1; i < d->count; i++) {
+        DirtyRect r = d->rects[i];
+        int j = i - 1;
+        while (j >= 0 && d->rects[j].y > r.y) {
+            d->rects[j + 1] = d->rects[j];
+            j--;
+        }
+        d->rects[j + 1] = r;
+    }
+
+    int i = 0;
+    while (i < d->count) {
+        int y0 = d->rects[i].y;
+        int y1 = d->rects[i].y + d->rects[i].h;
+        long separateCost = rect_upload_cost(plane, &d->rects[i]);
+        int last = i;
+
+        // grow the band while one bigger upload is cheaper than separate ones
+        while (last + 1 < d->count) {
+            const DirtyRect* next = &d->rects[last + 1];
+            int ny1 = next->y + next->h > y1 ? next->y + next->h : y1;
+            long bandCost = (long)plane->width * (long)(ny1 - y0) + UPLOAD_CALL_COST_PIXELS;
+            long nextSeparate = separateCost + rect_upload_cost(plane, next);
+            if (bandCost > nextSeparate) break;
+            y1 = ny1;
+            separateCost = nextSeparate;
+            last++;
+        }
+
+        long bandCost = (long)plane->width * (long)(y1 - y0) + UPLOAD_CALL_COST_PIXELS;
+        if (last > i || bandCost <= separateCost) {
+            upload_band(plane, y0, y1);
+        } else {
+            upload_rect(plane, up, &d->rects[i]);
+        }
+        i = last + 1;
+    }
+    d->count = 0;
+}
+
+static TexturePlane luminance_plane(const unsigned char* pixels, int width, int height)
+{
+    TexturePlane p;
+    p.pixels = (const char*)pixels;
+    p.width = width;
+    p.height = height;
+    p.stride = width;
+    p.bytesPerPixel = 1;
+    p.format = GL_LUMINANCE;
+    p.type = GL_UNSIGNED_BYTE;
+    return p;
+}
+
+static void texture_upload_planes(Canvas* canvas, TextureUploader* up)
+{
+    CanvasPlanes* pl = canvas->planes;
+    TexturePlane y = luminance_plane(pl->y, canvas->width, canvas->height);
+    TexturePlane cb = luminance_plane(pl->cb, pl->chromaWidth, pl->chromaHeight);
+    TexturePlane cr = luminance_plane(pl->cr, pl->chromaWidth, pl->chromaHeight);
+    TexturePlane mask = luminance_plane(pl->mask, canvas->width, canvas->height);
+
+    if (!up->planeTextures[0]) {
+        glGenTextures(4, up->planeTextures);
+        const TexturePlane* planes[4] = { &y, &cb, &cr, &mask };
+        for (int i = 0; i < 4; i++) {
+            glActiveTexture(GL_TEXTURE1 + i);
+            glBindTexture(GL_TEXTURE_2D, up->planeTextures[i]);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, planes[i]->width, planes[i]->height,
+                         0, GL_LUMINANCE, GL_UNSIGNED_BYTE, NULL);
+        }
+    }
+
+    // chroma rects: the same damage at half resolution
+    DirtyRegion chroma = pl->dirty;
+    for (int i = 0; i < chroma.count; i++) rect_to_chroma(&chroma.rects[i]);
+    DirtyRegion chromaCr = chroma;
+    DirtyRect chromaClip = canvas->visible;
+    rect_to_chroma(&chromaClip);
+
+    glActiveTexture(GL_TEXTURE1);
+    texture_upload_region(&y, &pl->dirty, &canvas->visible, up);
+    glActiveTexture(GL_TEXTURE2);
+    texture_upload_region(&cb, &chroma, &chromaClip, up);
+    glActiveTexture(GL_TEXTURE3);
+    texture_upload_region(&cr, &chromaCr, &chromaClip, up);
+    glActiveTexture(GL_TEXTURE4);
+    texture_upload_region(&mask, &pl->maskDirty, &canvas->visible, up);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// Uploads everything marked dirty and clears the dirty lists. The canvas
+// texture must be bound on unit 0.
+static void texture_upload_dirty(Canvas* canvas, TextureUploader* up)
+{
+    TexturePlane pixels = canvas_plane(canvas);
+    texture_upload_region(&pixels, &canvas->dirty, &canvas->visible, up);
+
+    if (canvas->planes) texture_upload_planes(canvas, up);
+}
+
+static void texture_uploader_free(TextureUploader* up)
+{
+    if (up->planeTextures[0]) glDeleteTextures(4, up->planeTextures);
+    if (up->paletteTexture) glDeleteTextures(1, &up->paletteTexture);
+    if (up->cursorTexture) glDeleteTextures(1, &up->cursorTexture);
+    up->paletteTexture = 0;
+    up->cursorTexture = 0;
+    free(up->scratch);
+    up->scratch = NULL;
+    up->scratchSize = 0;
+    memset(up->planeTextures, 0, sizeof(up->planeTextures));
+}
+
+// ---------------- Cursor overlay ----------------
+// The pointer is a second, small quad drawn with blending after the VNC quad.
+// Its corners are the cursor rect's canvas texcoords pushed through the VNC
+// quad's texcoord -> position mapping (affine, from corners 0, 1 and 3), and
+// it is clipped to the texcoord box so it never leaves the cropped picture.
+// A move only changes these four vertices.
+static int quad_map(const GLfloat* v, const GLfloat* tc, float u, float t, GLfloat* out)
+{
+    float e1u = tc[2] - tc[0], e1t = tc[3] - tc[1];
+    float e2u = tc[6] - tc[0], e2t = tc[7] - tc[1];
+    float det = e1u * e2t - e1t * e2u;
+    if (det == 0.0f) return -1;
+    float du = u - tc[0], dt = t - tc[1];
+    float a = (du * e2t - dt * e2u) / det;
+    float b = (e1u * dt - e1t * du) / det;
+    for (int k = 0; k < 2; k++) out[k] = v[k] + a * (v[3 + k] - v[k]) + b * (v[9 + k] - v[k]);
+    out[2] = 0.0f;
+    return 0;
+}
+
+// Draws the cursor over the frame; canvasTexture is rebound on unit 0 after.
+static void cursor_draw(CanvasCursor* cur, const Canvas* canvas, TextureUploader* up, GLuint canvasTexture)
+{
+    if (!cur || !cur->positioned || cur->width == 0 || cur->height == 0) return;
+
+    if (!up->cursorTexture) {
+        glGenTextures(1, &up->cursorTexture);
+        glBindTexture(GL_TEXTURE_2D, up->cursorTexture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        cur->imageDirty = 1;
+    } else {
+        glBindTexture(GL_TEXTURE_2D, up->cursorTexture);
+    }
+    if (cur->imageDirty) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, cur->width, cur->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, cur->rgba);
+        cur->imageDirty = 0;
+    }
+
+    const int landscape = canvas->width > canvas->height;
+    const GLfloat* v = landscape ? landscapeVertices : portraitVertices;
+    const GLfloat* tc = landscape ? landscapeTexCoords : portraitTexCoords;
+    float u0 = tc[0], u1 = tc[0], t0 = tc[1], t1 = tc[1];
+    for (int i = 1; i < 4; i++) {
+        if (tc[i * 2] < u0) u0 = tc[i * 2];
+        if (tc[i * 2] > u1) u1 = tc[i * 2];
+        if (tc[i * 2 + 1] < t0) t0 = tc[i * 2 + 1];
+        if (tc[i * 2 + 1] > t1) t1 = tc[i * 2 + 1];
+    }
+
+    // cursor rect in canvas texcoords, clipped to the box; s/r follow in cursor texcoords
+    float x0 = (float)(cur->x - cur->hotX) / canvas->width;
+    float y0 = (float)(cur->y - cur->hotY) / canvas->height;
+    float x1 = x0 + (float)cur->width / canvas->width;
+    float y1 = y0 + (float)cur->height / canvas->height;
+    float cu0 = x0 > u0 ? x0 : u0, cu1 = x1 < u1 ? x1 : u1;
+    float ct0 = y0 > t0 ? y0 : t0, ct1 = y1 < t1 ? y1 : t1;
+    GLfloat positions[12];
+    if (cu0 < cu1 && ct0 < ct1 &&
+        quad_map(v, tc, cu0, ct0, positions + 0) == 0 && quad_map(v, tc, cu1, ct0, positions + 3) == 0 &&
+        quad_map(v, tc, cu1, ct1, positions + 6) == 0 && quad_map(v, tc, cu0, ct1, positions + 9) == 0) {
+        float s0 = (cu0 - x0) / (x1 - x0), s1 = (cu1 - x0) / (x1 - x0);
+        float r0 = (ct0 - y0) / (y1 - y0), r1 = (ct1 - y0) / (y1 - y0);
+        GLfloat texCoords[8] = { s0, r0, s1, r0, s1, r1, s0, r1 };
+
+        glUseProgram(programObject);
+        GLint positionAttribute = glGetAttribLocation(programObject, "position");
+        GLint texCoordAttrib    = glGetAttribLocation(programObject, "texCoord");
+        glVertexAttribPointer(positionAttribute, 3, GL_FLOAT, GL_FALSE, 0, positions);
+        glVertexAttribPointer(texCoordAttrib,    2, GL_FLOAT, GL_FALSE, 0, texCoords);
+        glEnableVertexAttribArray(positionAttribute);
+        glEnableVertexAttribArray(texCoordAttrib);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+        glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+
+        glDisable(GL_BLEND);
+        glDisableVertexAttribArray(positionAttribute);
+        glDisableVertexAttribArray(texCoordAttrib);
+    }
+    glBindTexture(GL_TEXTURE_2D, canvasTexture);
+}
+
+// ---------------- Decoder state ----------------
+// Per-connection decoder state; zlib streams persist across rects and frames.
+struct RfbDecoders {
+    z_stream zlib; // encoding 6
+    int zlibRowsLeft; // rows of the current Zlib rect next_out has not reached yet
+    z_stream zrle; // encoding 16, a separate stream per the RFB spec
+    unsigned char* zrleWindow;
+    size_t zrleWindowSize;
+    size_t zrleWindowFill;    // inflated bytes kept for a tile still waiting on input
+    struct DecodePool* workers; // decode threads, started on first use
+    struct TileBatch* tiles;  // ZRLE / TRLE / Hextile tiles handed to the workers
+    struct TightPool* tight;  // encoding 7 streams, created on first use
+    int* tightGradientRow;    // gradient filter for rects decoded inline
+    size_t tightGradientRowSize;
+    struct JpegDecoder* jpeg; // Tight JPEG rects, allocated on first use
+};
+
+static void tight_pool_destroy(struct TightPool* pool);
+static void decode_pool_destroy(struct DecodePool* pool);
+static void tile_batch_free(struct TileBatch* b);
+static void jpeg_decoder_free(struct JpegDecoder* jd);
+
+static int decoders_init(RfbDecoders* dec)
+{
+    memset(dec, 0, sizeof(*dec));
+    if (inflateInit(&dec->zlib) != Z_OK) return -1;
+    if (inflateInit(&dec->zrle) != Z_OK) {
+        inflateEnd(&dec->zlib);
+        return -1;
+    }
+    return 0;
+}
+
+static void decoders_free(RfbDecoders* dec)
+{
+    inflateEnd(&dec->zlib);
+    inflateEnd(&dec->zrle);
+    free(dec->zrleWindow);
+    tight_pool_destroy(dec->tight);
+    decode_pool_destroy(dec->workers);
+    tile_batch_free(dec->tiles);
+    free(dec->tightGradientRow);
+    jpeg_decoder_free(dec->jpeg);
+    memset(dec, 0, sizeof(*dec));
+}
+
+// ---------------- SIMD kernels ----------------
+// Run fills, palette lookups and 24->32 bit expansion used by the tile
+// decoders. NEON is picked up when the compiler targets it (-mfpu=neon),
+// SSE2/SSSE3 on the x86 simulator build; everything else uses the scalar path.
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VNC_NEON 1
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define VNC_SSE2 1
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define VNC_SSSE3 1
+#endif
+
+static inline void fill_run(uint8_t* dst, uint8_t value, int n)
+{
+    memset(dst, value, (size_t)n);
+}
+
+static inline void fill_run(uint16_t* dst, uint16_t value, int n)
+{
+    for (int i = 0; i < n; i++) dst[i] = value;
+}
+
+static inline void fill_run(uint32_t* dst, uint32_t value, int n)
+{
+    int i = 0;
+#if defined(VNC_NEON)
+    uint32x4_t v = vdupq_n_u32(value);
+    for (; i + 4 <= n; i += 4) vst1q_u32(dst + i, v);
+#elif defined(VNC_SSE2)
+    __m128i v = _mm_set1_epi32((int)value);
+    for (; i + 4 <= n; i += 4) _mm_storeu_si128((__m128i*)(dst + i), v);
+#endif
+    for (; i < n; i++) dst[i] = value;
+}
+
+// Palette of up to 256 entries; palettes of 16 or fewer are split into byte
+// planes once per tile so the vector paths can use table lookups (vtbl / pshufb).
+template <typename P>
+struct PaletteLut {
+    P entries[256];
+    int size;
+#if defined(VNC_NEON) || defined(VNC_SSSE3)
+    uint8_t planes[4][16];
+#endif
+};
+
+template <typename P>
+static void palette_prepare(PaletteLut<P>* lut)
+{
+#if defined(VNC_NEON) || defined(VNC_SSSE3)
+    if (sizeof(P) != 4 || lut->size > 16) return;
+    for (int i = 0; i < 16; i++) {
+        const uint8_t* b = (const uint8_t*)&lut->entries[i];
+        for (int k = 0; k < 4; k++) lut->planes[k][i] = b[k];
+    }
+#else
+    (void)lut;
+#endif
+}
+
+template <typename P>
+static inline void palette_lookup(P* dst, const uint8_t* idx, int n, const PaletteLut<P>* lut)
+{
+    for (int i = 0; i < n; i++) dst[i] = lut->entries[idx[i]];
+}
+
+static inline void palette_lookup(uint32_t* dst, const uint8_t* idx, int n, const PaletteLut<uint32_t>* lut)
+{
+    int i = 0;
+#if defined(VNC_NEON)
+    if (lut->size <= 16) {
+        uint8x8x2_t t0, t1, t2, t3;
+        t0.val[0] = vld1_u8(lut->planes[0]); t0.val[1] = vld1_u8(lut->planes[0] + 8);
+        t1.val[0] = vld1_u8(lut->planes[1]); t1.val[1] = vld1_u8(lut->planes[1] + 8);
+        t2.val[0] = vld1_u8(lut->planes[2]); t2.val[1] = vld1_u8(lut->planes[2] + 8);
+        t3.val[0] = vld1_u8(lut->planes[3]); t3.val[1] = vld1_u8(lut->planes[3] + 8);
+        for (; i + 8 <= n; i += 8) {
+            uint8x8_t ix = vld1_u8(idx + i);
+            uint8x8x4_t px;
+            px.val[0] = vtbl2_u8(t0, ix);
+            px.val[1] = vtbl2_u8(t1, ix);
+            px.val[2] = vtbl2_u8(t2, ix);
+            px.val[3] = vtbl2_u8(t3, ix);
+            vst4_u8((uint8_t*)(dst + i), px);
+        }
+    }
+#elif defined(VNC_SSSE3)
+    if (lut->size <= 16) {
+        __m128i t0 = _mm_loadu_si128((const __m128i*)lut->planes[0]);
+        __m128i t1 = _mm_loadu_si128((const __m128i*)lut->planes[1]);
+        __m128i t2 = _mm_loadu_si128((const __m128i*)lut->planes[2]);
+        __m128i t3 = _mm_loadu_si128((const __m128i*)lut->planes[3]);
+        for (; i + 16 <= n; i += 16) {
+            __m128i ix = _mm_loadu_si128((const __m128i*)(idx + i));
+            __m128i b0 = _mm_shuffle_epi8(t0, ix);
+            __m128i b1 = _mm_shuffle_epi8(t1, ix);
+            __m128i b2 = _mm_shuffle_epi8(t2, ix);
+            __m128i b3 = _mm_shuffle_epi8(t3, ix);
+            __m128i lo01 = _mm_unpacklo_epi8(b0, b1);
+            __m128i hi01 = _mm_unpackhi_epi8(b0, b1);
+            __m128i lo23 = _mm_unpacklo_epi8(b2, b3);
+            __m128i hi23 = _mm_unpackhi_epi8(b2, b3);
+            _mm_storeu_si128((__m128i*)(dst + i),      _mm_unpacklo_epi16(lo01, lo23));
+            _mm_storeu_si128((__m128i*)(dst + i + 4),  _mm_unpackhi_epi16(lo01, lo23));
+            _mm_storeu_si128((__m128i*)(dst + i + 8),  _mm_unpacklo_epi16(hi01, hi23));
+            _mm_storeu_si128((__m128i*)(dst + i + 12), _mm_unpackhi_epi16(hi01, hi23));
+        }
+    }
+#endif
+    for (; i < n; i++) dst[i] = lut->entries[idx[i]];
+}
+
+// n wire pixels -> canvas pixels
+template <typename P>
+static inline void cpixels_load_row(P* dst, const unsigned char* src, int n, const CPixelFormat* cf)
+{
+    if (cf->size == (int)sizeof(P)) {
+        memcpy(dst, src, (size_t)n * sizeof(P));
+        return;
+    }
+    for (int i = 0; i < n; i++) dst[i] = cpixel_load<P>(src + i * cf->size, cf);
+}
+
+static inline void cpixels_load_row(uint32_t* dst, const unsigned char* src, int n, const CPixelFormat* cf)
+{
+    if (cf->size == 4) {
+        memcpy(dst, src, (size_t)n * 4u);
+        return;
+    }
+    int i = 0;
+#if defined(VNC_NEON)
+    uint8x8_t opaque = vdup_n_u8(0xFF);
+    for (; i + 8 <= n; i += 8) {
+        uint8x8x3_t c = vld3_u8(src + i * 3);
+        uint8x8x4_t px;
+        if (cf->offset == 0) {
+            px.val[0] = c.val[0]; px.val[1] = c.val[1]; px.val[2] = c.val[2]; px.val[3] = opaque;
+        } else {
+            px.val[0] = opaque; px.val[1] = c.val[0]; px.val[2] = c.val[1]; px.val[3] = c.val[2];
+        }
+        vst4_u8((uint8_t*)(dst + i), px);
+    }
+#endif
+    for (; i < n; i++) dst[i] = cpixel_load<uint32_t>(src + i * 3, cf);
+}
+
+// ---------------- Decode thread pool ----------------
+// decodeThreads workers shared by the decoders. Every worker owns a deque:
+// it takes its own tasks newest first and, once that runs dry, steals the
+// oldest task of another worker, so a burst of work spreads over all cores
+// without one queue everybody contends on. Tasks from outside the pool (the
+// network thread) are dealt out round-robin. ZRLE, TRLE and Hextile rects
+// are cut into runs of tiles (see Parallel tiles); work that must stay in
+// order, like one Tight zlib stream, is a single task that drains its own
+// queue.
+#define DECODE_MAX_THREADS 8
+#define DECODE_DEQUE_SIZE  32
+
+struct DecodeTask {
+    void (*run)(void* arg);
+    void* arg;
+};
+
+struct DecodeWorker {
+    pthread_t thread;
+    struct DecodePool* pool;
+    int index;
+    pthread_mutex_t lock;  // this deque only
+    DecodeTask tasks[DECODE_DEQUE_SIZE];
+    unsigned top;          // oldest task, taken by thieves
+    unsigned bottom;       // one past the newest, pushed and popped by the owner
+};
+
+struct DecodePool {
+    DecodeWorker workers[DECODE_MAX_THREADS];
+    int threadCount;       // deques, fixed before any worker starts
+    int running;           // workers actually started; an idle deque still gets stolen from
+    pthread_mutex_t lock;  // sleeping and waking only
+    pthread_cond_t work;
+    volatile int queued;   // tasks sitting in any deque
+    int stop;
+    unsigned nextWorker;   // round-robin for outside submitters
+};
+
+static int decode_deque_push(DecodeWorker* wk, const DecodeTask* task)
+{
+    pthread_mutex_lock(&wk->lock);
+    int ok = wk->bottom - wk->top < DECODE_DEQUE_SIZE;
+    if (ok) wk->tasks[wk->bottom++ % DECODE_DEQUE_SIZE] = *task;
+    pthread_mutex_unlock(&wk->lock);
+    return ok;
+}
+
+// owner end: the newest task, whose data is most likely still in cache
+static int decode_deque_pop(DecodeWorker* wk, DecodeTask* task)
+{
+    pthread_mutex_lock(&wk->lock);
+    int ok = wk->bottom != wk->top;
+    if (ok) *task = wk->tasks[--wk->bottom % DECODE_DEQUE_SIZE];
+    pthread_mutex_unlock(&wk->lock);
+    return ok;
+}
+
+// thief end: the oldest task
+static int decode_deque_steal(DecodeWorker* wk, DecodeTask* task)
+{
+    pthread_mutex_lock(&wk->lock);
+    int ok = wk->bottom != wk->top;
+    if (ok) *task = wk->tasks[wk->top++ % DECODE_DEQUE_SIZE];
+    pthread_mutex_unlock(&wk->lock);
+    return ok;
+}
+
+static void* decode_worker_main(void* arg)
+{
+    DecodeWorker* wk = (DecodeWorker*)arg;
+    DecodePool* pool = wk->pool;
+    for (;;) {
+        DecodeTask task;
+        int got = decode_deque_pop(wk, &task);
+        for (int i = 1; !got && i < pool->threadCount; i++) {
+            got = decode_deque_steal(&pool->workers[(wk->index + i) % pool->threadCount], &task);
+        }
+        if (got) {
+            __sync_fetch_and_sub(&pool->queued, 1);
+            task.run(task.arg);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (__sync_fetch_and_add(&pool->queued, 0) == 0 && !pool->stop) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        int stop = pool->stop && __sync_fetch_and_add(&pool->queued, 0) == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) break;
+    }
+    return NULL;
+}
+
+static void decode_pool_destroy(DecodePool* pool)
+{
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->running; i++) pthread_join(pool->workers[i].thread, NULL);
+    for (int i = 0; i < pool->threadCount; i++) pthread_mutex_destroy(&pool->workers[i].lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+// threads <= 0 means one per online CPU
+static DecodePool* decode_pool_create(int threads)
+{
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 2;
+    if (threads > DECODE_MAX_THREADS) threads = DECODE_MAX_THREADS;
+
+    DecodePool* pool = (DecodePool*)calloc(1, sizeof(DecodePool));
+    if (!pool) return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    for (int i = 0; i < threads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pthread_mutex_init(&pool->workers[i].lock, NULL);
+    }
+    pool->threadCount = threads;
+    while (pool->running < threads &&
+           pthread_create(&pool->workers[pool->running].thread, NULL, decode_worker_main,
+                          &pool->workers[pool->running]) == 0) {
+        pool->running++;
+    }
+    if (pool->running == 0) {
+        decode_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+// Returns -1 when every deque is full; the caller then runs the task itself.
+static int decode_pool_submit(DecodePool* pool, void (*run)(void*), void* arg)
+{
+    DecodeTask task;
+    task.run = run;
+    task.arg = arg;
+    unsigned first = pool->nextWorker++;
+    for (int i = 0; i < pool->threadCount; i++) {
+        if (!decode_deque_push(&pool->workers[(first + i) % pool->threadCount], &task)) continue;
+        __sync_fetch_and_add(&pool->queued, 1);
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+    }
+    return -1;
+}
+
+// ---------------- Byte sources for tile decoders ----------------
+// Tile decoders read through a ByteSource: cur/end is the readable window and
+// refill() makes at least `need` contiguous bytes available (0) or fails (-1).
+// mark is where the last complete tile ended.
+struct ByteSource {
+    const unsigned char* cur;
+    const unsigned char* end;
+    const unsigned char* mark;
+    int (*refill)(ByteSource* src, size_t need);
+    void* ctx;
+};
+
+static inline int source_need(ByteSource* src, size_t need)
+{
+    if ((size_t)(src->end - src->cur) >= need) return 0;
+    return src->refill(src, need);
+}
+
+// Inflates the compressed bytes of one rect on demand into a reusable window.
+// Compressed bytes are fed as they arrive, so the window may run dry in the
+// middle of a tile: with more input still to come that sets wouldBlock, and
+// everything from mark (the tile's first byte) stays in the window for the
+// retry.
+struct InflateSource {
+    ByteSource src;
+    z_stream* strm;
+    unsigned char** window;
+    size_t* windowSize;
+    int more;       // the rect has compressed bytes that are not in strm yet
+    int wouldBlock;
+    FrameTimings* timings;
+};
+
+static int inflate_refill(ByteSource* src, size_t need)
+{
+    InflateSource* is = (InflateSource*)src->ctx;
+    size_t keep = (size_t)(src->end - src->mark);
+    size_t pos = (size_t)(src->cur - src->mark);
+    need += pos;
+
+    size_t wanted = need > 65536 ? need : 65536;
+    if (*is->windowSize < wanted) {
+        unsigned char* tmp = (unsigned char*)malloc(wanted);
+        if (!tmp) return -1;
+        if (keep) memcpy(tmp, src->mark, keep);
+        free(*is->window);
+        *is->window = tmp;
+        *is->windowSize = wanted;
+    } else if (keep && src->mark != *is->window) {
+        memmove(*is->window, src->mark, keep);
+    }
+    src->mark = *is->window;
+    src->cur = *is->window + pos;
+
+    size_t have = keep;
+    uint64_t infStart = now_us();
+    while (have < need) {
+        // even without input, inflate may hold output a full window cut off
+        is->strm->next_out  = (Bytef*)(*is->window + have);
+        is->strm->avail_out = (uInt)(*is->windowSize - have);
+        int ret = inflate(is->strm, Z_SYNC_FLUSH);
+        size_t produced = (*is->windowSize - have) - is->strm->avail_out;
+        have += produced;
+        if (ret < 0 && ret != Z_BUF_ERROR) break;
+        if (produced == 0 && ret == Z_BUF_ERROR) break;
+    }
+    if (is->timings) is->timings->inflate_ms += us_to_ms(now_us() - infStart);
+
+    src->end = *is->window + have;
+    if (have >= need) return 0;
+    if (is->strm->avail_in == 0 && is->more) is->wouldBlock = 1;
+    return -1;
+}
+
+// Received bytes the parser has not consumed yet: [rd, wr) of buf.
+struct RfbInput {
+    unsigned char* buf;
+    size_t size;
+    size_t rd;
+    size_t wr;
+};
+
+// the input ran out; call again once more bytes are buffered
+#define RFB_NEED_MORE 1
+
+// Reads the buffered input in place (TRLE, Hextile). Running out is not a
+// stream error: wouldBlock is set and `need` is what the interrupted tile
+// wants counted from mark, so the tile can be decoded again from its first
+// byte later.
+struct BufferSource {
+    ByteSource src;
+    int wouldBlock;
+    size_t need;
+};
+
+static int buffer_refill(ByteSource* src, size_t need)
+{
+    BufferSource* bs = (BufferSource*)src->ctx;
+    bs->wouldBlock = 1;
+    bs->need = (size_t)(src->cur - src->mark) + need;
+    return -1;
+}
+
+static void buffer_source_init(BufferSource* bs, const RfbInput* in)
+{
+    bs->src.cur = bs->src.mark = in->buf + in->rd;
+    bs->src.end = in->buf + in->wr;
+    bs->src.refill = buffer_refill;
+    bs->src.ctx = bs;
+    bs->wouldBlock = 0;
+    bs->need = 0;
+}
+
+// Consumes the tiles that completed; one cut short turns into RFB_NEED_MORE.
+static int buffer_source_finish(BufferSource* bs, RfbInput* in, int ret, size_t* need)
+{
+    in->rd = (size_t)(bs->src.mark - in->buf);
+    if (ret != 0 && bs->wouldBlock) {
+        *need = bs->need;
+        return RFB_NEED_MORE;
+    }
+    return ret;
+}
+
+// Where a tiled rect stopped when its input ran dry: tiles before `tile` are
+// in the canvas. Hextile colours are saved after each complete tile. The
+// TRLE palette is updated in place, which is fine because a retried tile
+// re-reads any palette it replaced.
+struct TileCursor {
+    int tile;
+    uint32_t bg, fg;
+    PaletteLut<uint8_t> lut8;
+    PaletteLut<uint16_t> lut16;
+    PaletteLut<uint32_t> lut32;
+};
+
+static inline PaletteLut<uint8_t>* tile_lut(TileCursor* tc, uint8_t*) { return &tc->lut8; }
+static inline PaletteLut<uint16_t>* tile_lut(TileCursor* tc, uint16_t*) { return &tc->lut16; }
+static inline PaletteLut<uint32_t>* tile_lut(TileCursor* tc, uint32_t*) { return &tc->lut32; }
+
+// ---------------- ZRLE / TRLE tiles ----------------
+// Subencodings: 0 raw, 1 solid, 2-16 packed palette, 128 plain RLE,
+// 130-255 palette RLE. TRLE adds 127/129, which reuse the previous tile's
+// palette. Pixels go straight into the canvas.
+template <typename P>
+static int rle_tile_decode(ByteSource* src, Canvas* canvas, int tx, int ty, int tw, int th,
+                           const CPixelFormat* cf, PaletteLut<P>* lut, int trle)
+{
+    const int cpx = cf->size;
+    P* rows = (P*)(canvas->pixels + (size_t)ty * canvas->stride) + tx;
+    const int rowPixels = canvas->stride / (int)sizeof(P);
+
+    if (source_need(src, 1) != 0) return -1;
+    int sub = *src->cur++;
+
+    if (sub == 0) {
+        size_t rowBytes = (size_t)tw * (size_t)cpx;
+        for (int r = 0; r < th; r++) {
+            if (source_need(src, rowBytes) != 0) return -1;
+            cpixels_load_row(rows + r * rowPixels, src->cur, tw, cf);
+            src->cur += rowBytes;
+        }
+        return 0;
+    }
+
+    if (sub == 1) {
+        if (source_need(src, (size_t)cpx) != 0) return -1;
+        P p = cpixel_load<P>(src->cur, cf);
+        src->cur += cpx;
+        for (int r = 0; r < th; r++) fill_run(rows + r * rowPixels, p, tw);
+        return 0;
+    }
+
+    if ((sub >= 2 && sub <= 16) || (sub == 127 && trle)) {
+        if (sub == 127) {
+            if (lut->size < 2 || lut->size > 16) return -1;
+        } else {
+            lut->size = sub;
+            if (source_need(src, (size_t)sub * (size_t)cpx) != 0) return -1;
+            memset(lut->entries, 0, 16 * sizeof(P));
+            for (int i = 0; i < sub; i++) lut->entries[i] = cpixel_load<P>(src->cur + i * cpx, cf);
+            src->cur += sub * cpx;
+        }
+        palette_prepare(lut);
+
+        int bits = lut->size == 2 ? 1 : (lut->size <= 4 ? 2 : 4);
+        int mask = (1 << bits) - 1;
+        size_t rowBytes = ((size_t)tw * (size_t)bits + 7) / 8;
+        uint8_t idx[64];
+        for (int r = 0; r < th; r++) {
+            if (source_need(src, rowBytes) != 0) return -1;
+            const unsigned char* b = src->cur;
+            for (int i = 0; i < tw; i++) {
+                int bit = i * bits;
+                idx[i] = (uint8_t)((b[bit >> 3] >> (8 - bits - (bit & 7))) & mask);
+            }
+            palette_lookup(rows + r * rowPixels, idx, tw, lut);
+            src->cur += rowBytes;
+        }
+        return 0;
+    }
+
+    if (sub == 128 || sub >= 130 || (sub == 129 && trle)) {
+        int paletteRle = sub != 128;
+        if (sub == 129) {
+            if (lut->size < 1) return -1;
+        } else if (paletteRle) {
+            int n = sub - 128;
+            lut->size = n;
+            if (source_need(src, (size_t)n * (size_t)cpx) != 0) return -1;
+            for (int i = 0; i < n; i++) lut->entries[i] = cpixel_load<P>(src->cur + i * cpx, cf);
+            src->cur += n * cpx;
+        }
+
+        int total = tw * th;
+        int done = 0;
+        while (done < total) {
+            P p;
+            int runLength = 1;
+            if (paletteRle) {
+                if (source_need(src, 1) != 0) return -1;
+                int index = *src->cur++;
+                if (index & 128) {
+                    index &= 127;
+                    runLength = -1; // read below
+                }
+                if (index >= lut->size) return -1;
+                p = lut->entries[index];
+            } else {
+                if (source_need(src, (size_t)cpx) != 0) return -1;
+                p = cpixel_load<P>(src->cur, cf);
+                src->cur += cpx;
+                runLength = -1;
+            }
+            if (runLength < 0) {
+                runLength = 1;
+                int b;
+                do {
+                    if (source_need(src, 1) != 0) return -1;
+                    b = *src->cur++;
+                    runLength += b;
+                } while (b == 255);
+            }
+            if (runLength > total - done) return -1;
+
+            while (runLength > 0) {
+                int r = done / tw;
+                int c = done - r * tw;
+                int n = tw - c < runLength ? tw - c : runLength;
+                fill_run(rows + r * rowPixels + c, p, n);
+                done += n;
+                runLength -= n;
+            }
+        }
+        return 0;
+    }
+
+    return -1; // 17-127 and 129 are unused in ZRLE
+}
+
+template <typename P>
+static int rle_rect_decode(ByteSource* src, Canvas* canvas, int x, int y, int w, int h,
+                           int tileSize, const CPixelFormat* cf, int trle, TileCursor* tc)
+{
+    PaletteLut<P>* lut = tile_lut(tc, (P*)0);
+    if (tc->tile == 0) memset(lut, 0, sizeof(*lut));
+    int cols = (w + tileSize - 1) / tileSize;
+    int tiles = cols * ((h + tileSize - 1) / tileSize);
+    for (; tc->tile < tiles; tc->tile++) {
+        int tx = x + (tc->tile % cols) * tileSize;
+        int ty = y + (tc->tile / cols) * tileSize;
+        int tw = x + w - tx < tileSize ? x + w - tx : tileSize;
+        int th = y + h - ty < tileSize ? y + h - ty : tileSize;
+        if (rle_tile_decode<P>(src, canvas, tx, ty, tw, th, cf, lut, trle) != 0) return -1;
+        src->mark = src->cur;
+    }
+    return 0;
+}
+
+static int rle_rect_decode_any(ByteSource* src, Canvas* canvas, int x, int y, int w, int h,
+                               int tileSize, TileCursor* tc)
+{
+    CPixelFormat cf = cpixel_format(&canvas->format);
+    int trle = tileSize == 16;
+    switch (canvas->bytesPerPixel) {
+        case 1: return rle_rect_decode<uint8_t>(src, canvas, x, y, w, h, tileSize, &cf, trle, tc);
+        case 2: return rle_rect_decode<uint16_t>(src, canvas, x, y, w, h, tileSize, &cf, trle, tc);
+        case 4: return rle_rect_decode<uint32_t>(src, canvas, x, y, w, h, tileSize, &cf, trle, tc);
+    }
+    return -1;
+}
+
+// ---------------- Hextile (encoding 5) ----------------
+// 16x16 tiles with a subencoding mask; background/foreground colours carry
+// over between tiles of the same rect. Needs no inflate at all.
+#define HEXTILE_RAW                0x01
+#define HEXTILE_BACKGROUND         0x02
+#define HEXTILE_FOREGROUND         0x04
+#define HEXTILE_ANY_SUBRECTS       0x08
+#define HEXTILE_SUBRECTS_COLOURED  0x10
+
+template <typename P>
+static int hextile_tile_decode(ByteSource* src, Canvas* canvas, int tx, int ty, int tw, int th, P* bg, P* fg)
+{
+    CPixelFormat pf; // Hextile sends full pixels
+    pf.size = (int)sizeof(P);
+    pf.offset = 0;
+    const int rowPixels = canvas->stride / (int)sizeof(P);
+    P* rows = (P*)(canvas->pixels + (size_t)ty * canvas->stride) + tx;
+
+    if (source_need(src, 1) != 0) return -1;
+    int mask = *src->cur++;
+
+    if (mask & HEXTILE_RAW) {
+        size_t rowBytes = (size_t)tw * sizeof(P);
+        for (int r = 0; r < th; r++) {
+            if (source_need(src, rowBytes) != 0) return -1;
+            memcpy(rows + r * rowPixels, src->cur, rowBytes);
+            src->cur += rowBytes;
+        }
+        return 0;
+    }
+
+    if (mask & HEXTILE_BACKGROUND) {
+        if (source_need(src, sizeof(P)) != 0) return -1;
+        *bg = cpixel_load<P>(src->cur, &pf);
+        src->cur += sizeof(P);
+    }
+    if (mask & HEXTILE_FOREGROUND) {
+        if (source_need(src, sizeof(P)) != 0) return -1;
+        *fg = cpixel_load<P>(src->cur, &pf);
+        src->cur += sizeof(P);
+    }
+    for (int r = 0; r < th; r++) fill_run(rows + r * rowPixels, *bg, tw);
+
+    if (!(mask & HEXTILE_ANY_SUBRECTS)) return 0;
+
+    if (source_need(src, 1) != 0) return -1;
+    int count = *src->cur++;
+    int coloured = (mask & HEXTILE_SUBRECTS_COLOURED) != 0;
+    size_t subrectBytes = (coloured ? sizeof(P) : 0) + 2;
+    if (source_need(src, (size_t)count * subrectBytes) != 0) return -1;
+
+    for (int i = 0; i < count; i++) {
+        P colour = *fg;
+        if (coloured) {
+            colour = cpixel_load<P>(src->cur, &pf);
+            src->cur += sizeof(P);
+        }
+        int sx = src->cur[0] >> 4;
+        int sy = src->cur[0] & 0x0F;
+        int sw = (src->cur[1] >> 4) + 1;
+        int sh = (src->cur[1] & 0x0F) + 1;
+        src->cur += 2;
+        if (sx + sw > tw || sy + sh > th) return -1;
+        for (int r = sy; r < sy + sh; r++) fill_run(rows + r * rowPixels + sx, colour, sw);
+    }
+    return 0;
+}
+
+template <typename P>
+static int hextile_rect_decode(ByteSource* src, Canvas* canvas, int x, int y, int w, int h, TileCursor* tc)
+{
+    if (tc->tile == 0) tc->bg = tc->fg = 0;
+    P bg = (P)tc->bg, fg = (P)tc->fg;
+
+    int cols = (w + 15) / 16;
+    int tiles = cols * ((h + 15) / 16);
+    for (; tc->tile < tiles; tc->tile++) {
+        int tx = x + (tc->tile % cols) * 16;
+        int ty = y + (tc->tile / cols) * 16;
+        int tw = x + w - tx < 16 ? x + w - tx : 16;
+        int th = y + h - ty < 16 ? y + h - ty : 16;
+        if (hextile_tile_decode<P>(src, canvas, tx, ty, tw, th, &bg, &fg) != 0) return -1;
+        tc->bg = bg;
+        tc->fg = fg;
+        src->mark = src->cur;
+    }
+    return 0;
+}
+
+// ---------------- Parallel tiles ----------------
+// A ZRLE, TRLE or Hextile rect is one byte stream, but once its bytes are
+// at hand a scan of the tile headers alone (subencoding, palette, run
+// lengths, subrect counts; no pixels written) finds where every tile starts
+// and which Hextile colours or TRLE palette it inherits. The scanned tiles
+// are then cut into runs of equal tile counts and decoded on the decode pool,
+// the parser thread taking the first run itself; tiles of one rect never
+// share pixels. Fewer than TILE_PARALLEL_MIN_PIXELS, and the tile the input
+// ends in, go through the sequential decoders as before.
+// A batch is one span per tile rather than per tile row: a run may then
+// start at any tile, so a rect only a few ZRLE tile rows high still splits
+// over every worker, and a batch can end wherever the buffered input does.
+// 1024 tiles cover a whole 1920x1080 rect of 64x64 ZRLE tiles (510), or
+// eight 16-pixel Hextile rows across it, for at most 40 KB of spans.
+#define TILE_BATCH_MAX            1024       // tiles scanned ahead per batch
+#define TILE_PARALLEL_MIN_PIXELS  (64 * 64 * 4)
+#define TILE_RUNS_PER_THREAD      4          // more runs than threads, so stealing evens them out
+#define TILE_MAX_RUNS             (DECODE_MAX_THREADS * TILE_RUNS_PER_THREAD)
+
+#define TILE_ZRLE    0
+#define TILE_TRLE    1
+#define TILE_HEXTILE 2
+
+// Where a scanned tile starts and the state it decodes with. Colours and
+// palettes point at their bytes in the input; NULL means the value the
+// TileCursor had before the batch.
+struct TileSpan {
+    const unsigned char* data;
+    const unsigned char* bg;      // Hextile
+    const unsigned char* fg;
+    const unsigned char* palette; // ZRLE / TRLE
+    int paletteSize;
+};
+
+struct TileRun {
+    struct TileBatch* batch;
+    int first;
+    int count;
+};
+
+struct TileBatch {
+    TileSpan spans[TILE_BATCH_MAX + 1]; // the last one ends the last tile and holds the state after it
+    TileRun runs[TILE_MAX_RUNS];
+    int count;
+    int kind;
+    Canvas* canvas;
+    int x, y, w, h;
+    int tileSize;
+    int first;                // tile index of spans[0] within the rect
+    const TileCursor* cursor; // state before spans[0]
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int pending;              // runs still on the pool
+    int failed;
+};
+
+static TileBatch* tile_batch_new()
+{
+    TileBatch* b = (TileBatch*)calloc(1, sizeof(TileBatch));
+    if (!b) return NULL;
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->done, NULL);
+    return b;
+}
+
+static void tile_batch_free(TileBatch* b)
+{
+    if (!b) return;
+    pthread_cond_destroy(&b->done);
+    pthread_mutex_destroy(&b->lock);
+    free(b);
+}
+
+// Length of the ZRLE/TRLE tile at p, 0 if it is not complete before end, -1
+// if it is invalid. Follows rle_tile_decode; *palette/*paletteSize track the
+// palette later tiles may reuse.
+#define TILE_SCAN_NEED(n) do { if ((size_t)(end - q) < (size_t)(n)) return 0; } while (0)
+
+static long rle_tile_scan(const unsigned char* p, const unsigned char* end, int tw, int th, int cpx, int trle,
+                          const unsigned char** palette, int* paletteSize)
+{
+    const unsigned char* q = p;
+    TILE_SCAN_NEED(1);
+    int sub = *q++;
+
+    if (sub == 0) {
+        TILE_SCAN_NEED((size_t)tw * (size_t)th * (size_t)cpx);
+        q += (size_t)tw * (size_t)th * (size_t)cpx;
+    } else if (sub == 1) {
+        TILE_SCAN_NEED(cpx);
+        q += cpx;
+    } else if ((sub >= 2 && sub <= 16) || (sub == 127 && trle)) {
+        if (sub == 127) {
+            if (*paletteSize < 2 || *paletteSize > 16) return -1;
+        } else {
+            TILE_SCAN_NEED((size_t)sub * (size_t)cpx);
+            *palette = q;
+            *paletteSize = sub;
+            q += (size_t)sub * (size_t)cpx;
+        }
+        int bits = *paletteSize == 2 ? 1 : (*paletteSize <= 4 ? 2 : 4);
+        size_t bytes = ((size_t)tw * (size_t)bits + 7) / 8 * (size_t)th;
+        TILE_SCAN_NEED(bytes);
+        q += bytes;
+    } else if (sub == 128 || sub >= 130 || (sub == 129 && trle)) {
+        int paletteRle = sub != 128;
+        if (sub == 129) {
+            if (*paletteSize < 1) return -1;
+        } else if (paletteRle) {
+            TILE_SCAN_NEED((size_t)(sub - 128) * (size_t)cpx);
+            *palette = q;
+            *paletteSize = sub - 128;
+            q += (size_t)(sub - 128) * (size_t)cpx;
+        }
+        int total = tw * th;
+        int done = 0;
+        while (done < total) {
+            int runLength = 1;
+            if (paletteRle) {
+                TILE_SCAN_NEED(1);
+                int index = *q++;
+                if ((index & 127) >= *paletteSize) return -1;
+                if (!(index & 128)) {
+                    done++;
+                    continue;
+                }
+            } else {
+                TILE_SCAN_NEED(cpx);
+                q += cpx;
+            }
+            int b;
+            do {
+                TILE_SCAN_NEED(1);
+                b = *q++;
+                runLength += b;
+            } while (b == 255);
+            if (runLength > total - done) return -1;
+            done += runLength;
+        }
+    } else {
+        return -1;
+    }
+    return (long)(q - p);
+}
+
+// Same for a Hextile tile; *bg/*fg track the colours later tiles inherit.
+static long hextile_tile_scan(const unsigned char* p, const unsigned char* end, int tw, int th, int bpp,
+                              const unsigned char** bg, const unsigned char** fg)
+{
+    const unsigned char* q = p;
+    TILE_SCAN_NEED(1);
+    int mask = *q++;
+    if (mask & HEXTILE_RAW) {
+        TILE_SCAN_NEED((size_t)tw * (size_t)th * (size_t)bpp);
+        return (long)(q - p) + (long)tw * th * bpp;
+    }
+    if (mask & HEXTILE_BACKGROUND) {
+        TILE_SCAN_NEED(bpp);
+        *bg = q;
+        q += bpp;
+    }
+    if (mask & HEXTILE_FOREGROUND) {
+        TILE_SCAN_NEED(bpp);
+        *fg = q;
+        q += bpp;
+    }
+    if (mask & HEXTILE_ANY_SUBRECTS) {
+        TILE_SCAN_NEED(1);
+        int count = *q++;
+        size_t bytes = (size_t)count * ((mask & HEXTILE_SUBRECTS_COLOURED ? (size_t)bpp : 0) + 2);
+        TILE_SCAN_NEED(bytes);
+        q += bytes;
+    }
+    return (long)(q - p);
+}
+
+#undef TILE_SCAN_NEED
+
+// A span holds its whole tile, so running out means the scan was wrong.
+static int span_refill(ByteSource* src, size_t need)
+{
+    (void)src;
+    (void)need;
+    return -1;
+}
+
+template <typename P>
+static void tile_palette_load(PaletteLut<P>* lut, const TileSpan* span, const TileCursor* tc, const CPixelFormat* cf)
+{
+    if (!span->palette) {
+        *lut = *tile_lut((TileCursor*)tc, (P*)0);
+        return;
+    }
+    memset(lut->entries, 0, 16 * sizeof(P));
+    for (int i = 0; i < span->paletteSize; i++) lut->entries[i] = cpixel_load<P>(span->palette + i * cf->size, cf);
+    lut->size = span->paletteSize;
+}
+
+template <typename P>
+static int tile_run_decode(TileBatch* b, int first, int count)
+{
+    Canvas* canvas = b->canvas;
+    const TileSpan* spans = b->spans;
+    CPixelFormat cf = cpixel_format(&canvas->format);
+    CPixelFormat hf; // Hextile sends full pixels
+    hf.size = (int)sizeof(P);
+    hf.offset = 0;
+
+    PaletteLut<P> lut;
+    P bg = (P)b->cursor->bg, fg = (P)b->cursor->fg;
+    if (b->kind == TILE_HEXTILE) {
+        if (spans[first].bg) bg = cpixel_load<P>(spans[first].bg, &hf);
+        if (spans[first].fg) fg = cpixel_load<P>(spans[first].fg, &hf);
+    } else {
+        tile_palette_load<P>(&lut, &spans[first], b->cursor, &cf);
+    }
+
+    int cols = (b->w + b->tileSize - 1) / b->tileSize;
+    for (int i = first; i < first + count; i++) {
+        int tile = b->first + i;
+        int tx = b->x + (tile % cols) * b->tileSize;
+        int ty = b->y + (tile / cols) * b->tileSize;
+        int tw = b->x + b->w - tx < b->tileSize ? b->x + b->w - tx : b->tileSize;
+        int th = b->y + b->h - ty < b->tileSize ? b->y + b->h - ty : b->tileSize;
+        ByteSource src;
+        src.cur = src.mark = spans[i].data;
+        src.end = spans[i + 1].data;
+        src.refill = span_refill;
+        src.ctx = NULL;
+        int ret = b->kind == TILE_HEXTILE
+            ? hextile_tile_decode<P>(&src, canvas, tx, ty, tw, th, &bg, &fg)
+            : rle_tile_decode<P>(&src, canvas, tx, ty, tw, th, &cf, &lut, b->kind == TILE_TRLE);
+        if (ret != 0) return -1;
+    }
+    return 0;
+}
+
+static int tile_run_decode_any(TileBatch* b, int first, int count)
+{
+    switch (b->canvas->bytesPerPixel) {
+        case 1: return tile_run_decode<uint8_t>(b, first, count);
+        case 2: return tile_run_decode<uint16_t>(b, first, count);
+        case 4: return tile_run_decode<uint32_t>(b, first, count);
+    }
+    return -1;
+}
+
+// Decode pool task.
+static void tile_run_task(void* arg)
+{
+    TileRun* run = (TileRun*)arg;
+    TileBatch* b = run->batch;
+    int ret = tile_run_decode_any(b, run->first, run->count);
+    pthread_mutex_lock(&b->lock);
+    if (ret != 0) b->failed = 1;
+    if (--b->pending == 0) pthread_cond_signal(&b->done);
+    pthread_mutex_unlock(&b->lock);
+}
+
+// Moves the cursor past the batch as if its tiles had been decoded in order.
+template <typename P>
+static void tile_cursor_advance(TileCursor* tc, const TileBatch* b)
+{
+    const TileSpan* after = &b->spans[b->count];
+    if (b->kind == TILE_HEXTILE) {
+        CPixelFormat hf;
+        hf.size = (int)sizeof(P);
+        hf.offset = 0;
+        if (after->bg) tc->bg = cpixel_load<P>(after->bg, &hf);
+        if (after->fg) tc->fg = cpixel_load<P>(after->fg, &hf);
+    } else if (after->palette) {
+        CPixelFormat cf = cpixel_format(&b->canvas->format);
+        tile_palette_load<P>(tile_lut(tc, (P*)0), after, tc, &cf);
+    }
+    tc->tile += b->count;
+}
+
+// The decode pool, started on first use.
+static DecodePool* decoders_pool(RfbDecoders* dec)
+{
+    if (!dec->workers) dec->workers = decode_pool_create(decodeThreads);
+    return dec->workers;
+}
+
+// Scans the complete tiles in data[0, len) that follow tile tc->tile and,
+// when they add up to TILE_PARALLEL_MIN_PIXELS, decodes them on the pool.
+// Returns the bytes they took, 0 if it left them to the sequential decoder,
+// -1 on a stream error.
+static long tiles_decode_parallel(RfbDecoders* dec, TileCursor* tc, const unsigned char* data, size_t len,
+                                  Canvas* canvas, int kind, int x, int y, int w, int h)
+{
+    int tileSize = kind == TILE_ZRLE ? 64 : 16;
+    int cols = (w + tileSize - 1) / tileSize;
+    int tiles = cols * ((h + tileSize - 1) / tileSize);
+    if ((long)w * h < TILE_PARALLEL_MIN_PIXELS || tc->tile >= tiles) return 0;
+    DecodePool* pool = decoders_pool(dec);
+    if (!pool) return 0;
+    if (!dec->tiles && !(dec->tiles = tile_batch_new())) return 0;
+    TileBatch* b = dec->tiles;
+
+    if (tc->tile == 0) {
+        // what rle_rect_decode / hextile_rect_decode reset at a rect's start
+        tc->bg = tc->fg = 0;
+        memset(&tc->lut8, 0, sizeof(tc->lut8));
+        memset(&tc->lut16, 0, sizeof(tc->lut16));
+        memset(&tc->lut32, 0, sizeof(tc->lut32));
+    }
+    int cpx = cpixel_format(&canvas->format).size;
+    int bpp = canvas->bytesPerPixel;
+    TileSpan state;
+    memset(&state, 0, sizeof(state));
+    switch (bpp) {
+        case 1: state.paletteSize = tc->lut8.size; break;
+        case 2: state.paletteSize = tc->lut16.size; break;
+        case 4: state.paletteSize = tc->lut32.size; break;
+    }
+
+    const unsigned char* p = data;
+    const unsigned char* end = data + len;
+    long pixels = 0;
+    int count = 0;
+    while (count < TILE_BATCH_MAX && tc->tile + count < tiles) {
+        int tile = tc->tile + count;
+        int tw = x + w - (x + (tile % cols) * tileSize);
+        int th = y + h - (y + (tile / cols) * tileSize);
+        if (tw > tileSize) tw = tileSize;
+        if (th > tileSize) th = tileSize;
+        TileSpan next = state;
+        long n = kind == TILE_HEXTILE
+            ? hextile_tile_scan(p, end, tw, th, bpp, &next.bg, &next.fg)
+            : rle_tile_scan(p, end, tw, th, cpx, kind == TILE_TRLE, &next.palette, &next.paletteSize);
+        if (n < 0) return -1;
+        if (n == 0) break;
+        b->spans[count] = state;
+        b->spans[count].data = p;
+        state = next;
+        p += n;
+        pixels += (long)tw * th;
+        count++;
+    }
+    if (pixels < TILE_PARALLEL_MIN_PIXELS) return 0;
+    b->spans[count] = state;
+    b->spans[count].data = p;
+
+    b->count = count;
+    b->kind = kind;
+    b->canvas = canvas;
+    b->x = x; b->y = y; b->w = w; b->h = h;
+    b->tileSize = tileSize;
+    b->first = tc->tile;
+    b->cursor = tc;
+    b->failed = 0;
+
+    // runs of equal tile counts; uneven tiles are left to work stealing
+    int runCount = pool->threadCount * TILE_RUNS_PER_THREAD;
+    if (runCount > count) runCount = count;
+    for (int r = 0; r < runCount; r++) {
+        b->runs[r].batch = b;
+        b->runs[r].first = count * r / runCount;
+        b->runs[r].count = count * (r + 1) / runCount - b->runs[r].first;
+    }
+
+    int failed = 0;
+    for (int r = 1; r < runCount; r++) {
+        pthread_mutex_lock(&b->lock);
+        b->pending++;
+        pthread_mutex_unlock(&b->lock);
+        if (decode_pool_submit(pool, tile_run_task, &b->runs[r]) != 0) tile_run_task(&b->runs[r]);
+    }
+    if (tile_run_decode_any(b, b->runs[0].first, b->runs[0].count) != 0) failed = 1;
+    pthread_mutex_lock(&b->lock);
+    while (b->pending > 0) pthread_cond_wait(&b->done, &b->lock);
+    if (b->failed) failed = 1;
+    pthread_mutex_unlock(&b->lock);
+    if (failed) return -1;
+
+    switch (bpp) {
+        case 1: tile_cursor_advance<uint8_t>(tc, b); break;
+        case 2: tile_cursor_advance<uint16_t>(tc, b); break;
+        case 4: tile_cursor_advance<uint32_t>(tc, b); break;
+    }
+    return (long)(p - data);
+}
+
+// Inflates pending ZRLE input into zrleWindow until it holds `target` bytes
+// or the input runs dry. Returns -1 on a stream error.
+#define ZRLE_BATCH_BYTES (256 * 1024)
+
+static int zrle_window_inflate(RfbDecoders* dec, size_t target, FrameTimings* timings)
+{
+    if (dec->zrleWindowSize < target) {
+        unsigned char* tmp = (unsigned char*)realloc(dec->zrleWindow, target);
+        if (!tmp) return -1;
+        dec->zrleWindow = tmp;
+        dec->zrleWindowSize = target;
+    }
+    uint64_t infStart = now_us();
+    int ret = Z_OK;
+    while (dec->zrleWindowFill < target) {
+        dec->zrle.next_out  = (Bytef*)(dec->zrleWindow + dec->zrleWindowFill);
+        dec->zrle.avail_out = (uInt)(target - dec->zrleWindowFill);
+        ret = inflate(&dec->zrle, Z_SYNC_FLUSH);
+        size_t produced = (target - dec->zrleWindowFill) - dec->zrle.avail_out;
+        dec->zrleWindowFill += produced;
+        if (ret < 0 || produced == 0) break;
+    }
+    if (timings) timings->inflate_ms += us_to_ms(now_us() - infStart);
+    return ret < 0 && ret != Z_BUF_ERROR ? -1 : 0;
+}
+
+// ZRLE rect body: zlib data, `len` bytes of which are buffered now and
+// `remaining` in total. ZRLE keeps its own persistent z_stream; inflated
+// bytes of a tile that could not finish wait at the start of zrleWindow.
+// While the window fills up with enough complete tiles they are decoded on
+// the workers; the rest go through the sequential decoder.
+// Returns 0 when the rect is complete, RFB_NEED_MORE or -1; *used is what
+// went into inflate either way.
+static int decode_zrle(const unsigned char* data, size_t len, size_t remaining, size_t* used,
+                       Canvas* canvas, RfbDecoders* dec, TileCursor* tc,
+                       int x, int y, int w, int h, FrameTimings* timings)
+{
+    dec->zrle.next_in  = (Bytef*)data;
+    dec->zrle.avail_in = (uInt)len;
+    if ((long)w * h >= TILE_PARALLEL_MIN_PIXELS) {
+        for (;;) {
+            if (zrle_window_inflate(dec, dec->zrleWindowFill + ZRLE_BATCH_BYTES, timings) != 0) return -1;
+            long done = tiles_decode_parallel(dec, tc, dec->zrleWindow, dec->zrleWindowFill,
+                                              canvas, TILE_ZRLE, x, y, w, h);
+            if (done < 0) return -1;
+            if (done == 0) break;
+            dec->zrleWindowFill -= (size_t)done;
+            memmove(dec->zrleWindow, dec->zrleWindow + done, dec->zrleWindowFill);
+        }
+    }
+
+    InflateSource is;
+    is.strm = &dec->zrle;
+    is.window = &dec->zrleWindow;
+    is.windowSize = &dec->zrleWindowSize;
+    is.more = len < remaining;
+    is.wouldBlock = 0;
+    is.timings = timings;
+    is.src.cur = is.src.mark = dec->zrleWindow;
+    is.src.end = dec->zrleWindow + dec->zrleWindowFill;
+    is.src.refill = inflate_refill;
+    is.src.ctx = &is;
+
+    int ret = rle_rect_decode_any(&is.src, canvas, x, y, w, h, 64, tc);
+
+    // keep the stream in step even if the tiles did not use every byte
+    while (ret == 0 && dec->zrle.avail_in > 0) {
+        is.src.cur = is.src.mark = is.src.end;
+        if (inflate_refill(&is.src, 1) != 0) break;
+    }
+    *used = len - dec->zrle.avail_in;
+    dec->zrleWindowFill = 0;
+    if (ret != 0) {
+        if (!is.wouldBlock) return -1;
+        dec->zrleWindowFill = (size_t)(is.src.end - is.src.mark);
+        if (dec->zrleWindowFill && is.src.mark != dec->zrleWindow) {
+            memmove(dec->zrleWindow, is.src.mark, dec->zrleWindowFill);
+        }
+        return RFB_NEED_MORE;
+    }
+    if (*used < remaining) return RFB_NEED_MORE; // tiles done, trailing bytes still due
+    canvas_mark_dirty(canvas, x, y, w, h);
+    return 0;
+}
+
+// Decodes the complete tiles buffered in `in` on the workers, batch by
+// batch, as long as there are enough of them.
+static int tiles_consume_parallel(RfbDecoders* dec, RfbInput* in, TileCursor* tc, Canvas* canvas,
+                                  int kind, int x, int y, int w, int h)
+{
+    for (;;) {
+        long used = tiles_decode_parallel(dec, tc, in->buf + in->rd, in->wr - in->rd, canvas, kind, x, y, w, h);
+        if (used <= 0) return used < 0 ? -1 : 0;
+        in->rd += (size_t)used;
+    }
+}
+
+// TRLE rect: ZRLE-style 16x16 tiles sent without a zlib stream or a length.
+static int decode_trle(RfbInput* in, TileCursor* tc, size_t* need, Canvas* canvas, RfbDecoders* dec,
+                       int x, int y, int w, int h)
+{
+    if (tiles_consume_parallel(dec, in, tc, canvas, TILE_TRLE, x, y, w, h) != 0) return -1;
+    BufferSource bs;
+    buffer_source_init(&bs, in);
+    int ret = rle_rect_decode_any(&bs.src, canvas, x, y, w, h, 16, tc);
+    ret = buffer_source_finish(&bs, in, ret, need);
+    if (ret == 0) canvas_mark_dirty(canvas, x, y, w, h);
+    return ret;
+}
+
+static int decode_hextile(RfbInput* in, TileCursor* tc, size_t* need, Canvas* canvas, RfbDecoders* dec,
+                          int x, int y, int w, int h)
+{
+    if (tiles_consume_parallel(dec, in, tc, canvas, TILE_HEXTILE, x, y, w, h) != 0) return -1;
+    BufferSource bs;
+    buffer_source_init(&bs, in);
+    int ret = -1;
+    switch (canvas->bytesPerPixel) {
+        case 1: ret = hextile_rect_decode<uint8_t>(&bs.src, canvas, x, y, w, h, tc); break;
+        case 2: ret = hextile_rect_decode<uint16_t>(&bs.src, canvas, x, y, w, h, tc); break;
+        case 4: ret = hextile_rect_decode<uint32_t>(&bs.src, canvas, x, y, w, h, tc); break;
+    }
+    ret = buffer_source_finish(&bs, in, ret, need);
+    if (ret == 0) canvas_mark_dirty(canvas, x, y, w, h);
+    return ret;
+}
+
+// Zlib rect: length(4) + zlib data holding raw pixels in our format, through
+// the persistent zlib stream, inflated straight into the canvas. A full-width
+// rect is one contiguous block; a narrower one gets next_out moved to the
+// next canvas row each time a row fills up. zlib_rect_begin points the stream
+// at the first row; decode_zlib then inflates the `len` compressed bytes that
+// have arrived out of `remaining` in total. Returns 0 once all of them went
+// in, RFB_NEED_MORE or -1; *used is what was consumed.
+static void zlib_rect_begin(RfbDecoders* dec, const Canvas* canvas, int x, int y, int w, int h)
+{
+    size_t rowBytes = (size_t)w * (size_t)canvas->bytesPerPixel;
+    dec->zlib.next_out = (Bytef*)canvas->pixels + (size_t)y * canvas->stride + (size_t)x * canvas->bytesPerPixel;
+    if (x == 0 && w == canvas->width && (size_t)canvas->stride == rowBytes) {
+        dec->zlib.avail_out = (uInt)(rowBytes * (size_t)h);
+        dec->zlibRowsLeft = 0;
+    } else {
+        dec->zlib.avail_out = (uInt)(h > 0 ? rowBytes : 0);
+        dec->zlibRowsLeft = h > 0 ? h - 1 : 0;
+    }
+}
+
+static int decode_zlib(const unsigned char* data, size_t len, size_t remaining, size_t* used,
+                       Canvas* canvas, RfbDecoders* dec, int x, int y, int w, int h, FrameTimings* timings)
+{
+    z_stream* strm = &dec->zlib;
+    unsigned char sink[64];
+    strm->next_in  = (Bytef*)data;
+    strm->avail_in = (uInt)len;
+
+    uint64_t infStart = now_us();
+    for (;;) {
+        if (strm->avail_out == 0 && dec->zlibRowsLeft > 0) {
+            // inflate may still hold output for it even if avail_in is 0
+            int row = y + h - dec->zlibRowsLeft--;
+            strm->next_out  = (Bytef*)canvas->pixels + (size_t)row * canvas->stride + (size_t)x * canvas->bytesPerPixel;
+            strm->avail_out = (uInt)((size_t)w * (size_t)canvas->bytesPerPixel);
+        } else if (strm->avail_in == 0) {
+            break;
+        } else if (strm->avail_out == 0) {
+            // the rect is complete; the rest only keeps the stream in step
+            strm->next_out  = (Bytef*)sink;
+            strm->avail_out = (uInt)sizeof(sink);
+        }
+        if (inflate(strm, Z_SYNC_FLUSH) != Z_OK) break;
+    }
+    uint64_t infEnd = now_us();
+    if (timings) timings->inflate_ms += us_to_ms(infEnd - infStart);
+
+    *used = len - strm->avail_in;
+    if (strm->avail_in > 0) return -1;
+    if (*used < remaining) return RFB_NEED_MORE;
+
+    canvas_mark_dirty(canvas, x, y, w, h);
+    return 0;
+}
+
+// ---------------- JPEG (Tight subencoding 9) ----------------
+// Baseline sequential JPEG, decoded only as far as the IDCT: every component
+// stays an 8-bit plane at its own sampling resolution and the YCbCr->RGB step
+// happens in fragmentShaderSourceYCbCr. Progressive, arithmetic-coded and
+// 12-bit images are rejected; Tight servers do not produce them.
+#define JPEG_FAST_BITS 9
+#define JPEG_MAX_COMPONENTS 3
+
+// zigzag position -> natural (row-major) coefficient index
+static const uint8_t JPEG_ZIGZAG[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+struct JpegHuffman {
+    uint8_t fastLen[1 << JPEG_FAST_BITS]; // 0 = code longer than JPEG_FAST_BITS
+    uint8_t fastValue[1 << JPEG_FAST_BITS];
+    int maxCode[17];     // largest code of each length, -1 if there is none
+    int valueOffset[17]; // code + valueOffset[len] = index into values
+    uint8_t values[256];
+};
+
+struct JpegComponent {
+    int id;
+    int h, v;
+    int quant;
+    int dcTable, acTable;
+    int dcPred;
+    int width, height; // samples covered by the image
+    int stride;        // whole MCUs, so full blocks can always be written
+    unsigned char* plane;
+};
+
+struct JpegDecoder {
+    const unsigned char* cur;
+    const unsigned char* end;
+    uint32_t bits;  // MSB-first bit buffer
+    int bitCount;
+    int marker;     // marker reached inside entropy-coded data, 0 if none
+    uint16_t quant[4][64]; // zigzag order
+    JpegHuffman dc[4];
+    JpegHuffman ac[4];
+    JpegComponent comp[JPEG_MAX_COMPONENTS];
+    int compCount;
+    int hMax, vMax;
+    int width, height;
+    int mcusX, mcusY;
+    int restartInterval;
+    unsigned char* planes; // backing store for comp[].plane, grow-only
+    size_t planesSize;
+};
+
+static inline int jpeg_u16(const unsigned char* p) { return (p[0] << 8) | p[1]; }
+
+static int jpeg_build_huffman(JpegHuffman* hf, const unsigned char* counts, const unsigned char* values, int total)
+{
+    memset(hf->fastLen, 0, sizeof(hf->fastLen));
+    memcpy(hf->values, values, (size_t)total);
+    int code = 0;
+    int k = 0;
+    for (int len = 1; len <= 16; len++) {
+        hf->valueOffset[len] = k - code;
+        for (int i = 0; i < counts[len - 1]; i++, k++, code++) {
+            if (len <= JPEG_FAST_BITS) {
+                int shift = JPEG_FAST_BITS - len;
+                for (int f = code << shift; f < (code + 1) << shift; f++) {
+                    hf->fastLen[f] = (uint8_t)len;
+                    hf->fastValue[f] = values[k];
+                }
+            }
+        }
+        hf->maxCode[len] = counts[len - 1] ? code - 1 : -1;
+        if (code > (1 << len)) return -1; // over-subscribed table
+        code <<= 1;
+    }
+    return 0;
+}
+
+static void jpeg_fill(JpegDecoder* jd)
+{
+    while (jd->bitCount <= 24) {
+        uint32_t b = 0;
+        if (!jd->marker && jd->cur < jd->end) {
+            b = *jd->cur++;
+            if (b == 0xFF) {
+                int next = jd->cur < jd->end ? *jd->cur : 0xD9;
+                if (next == 0) {
+                    jd->cur++; // stuffed zero
+                } else {
+                    jd->marker = next; // stay on the 0xFF, feed zero bits from here on
+                    jd->cur--;
+                    b = 0;
+                }
+            }
+        }
+        jd->bits |= b << (24 - jd->bitCount);
+        jd->bitCount += 8;
+    }
+}
+
+static inline int jpeg_huff_decode(JpegDecoder* jd, const JpegHuffman* hf)
+{
+    if (jd->bitCount < 16) jpeg_fill(jd);
+    int f = (int)(jd->bits >> (32 - JPEG_FAST_BITS));
+    int len = hf->fastLen[f];
+    if (len) {
+        jd->bits <<= len;
+        jd->bitCount -= len;
+        return hf->fastValue[f];
+    }
+    for (len = JPEG_FAST_BITS + 1; len <= 16; len++) {
+        int c = (int)(jd->bits >> (32 - len));
+        if (c <= hf->maxCode[len]) {
+            jd->bits <<= len;
+            jd->bitCount -= len;
+            return hf->values[(c + hf->valueOffset[len]) & 0xFF];
+        }
+    }
+    return -1;
+}
+
+// RECEIVE + EXTEND from the spec: s raw bits as a signed magnitude
+static inline int jpeg_receive_extend(JpegDecoder* jd, int s)
+{
+    if (s == 0) return 0;
+    if (jd->bitCount < s) jpeg_fill(jd);
+    int v = (int)(jd->bits >> (32 - s));
+    jd->bits <<= s;
+    jd->bitCount -= s;
+    if (v < (1 << (s - 1))) v += 1 - (1 << s);
+    return v;
+}
+
+static inline unsigned char jpeg_clamp(int v)
+{
+    return (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+// Separable integer IDCT (the LL&M / jidctint factorisation, 12-bit
+// constants). Columns keep 2 extra bits of precision, rows descale and add
+// the +128 level shift.
+#define JPEG_FIX(x) ((int)((x) * 4096.0 + 0.5))
+
+struct JpegIdctOut { int x0, x1, x2, x3, t0, t1, t2, t3; };
+
+static inline void jpeg_idct_1d(int s0, int s1, int s2, int s3, int s4, int s5, int s6, int s7, JpegIdctOut* o)
+{
+    int p1 = (s2 + s6) * JPEG_FIX(0.5411961);
+    int t2 = p1 + s6 * JPEG_FIX(-1.847759065);
+    int t3 = p1 + s2 * JPEG_FIX(0.765366865);
+    int t0 = (s0 + s4) * 4096;
+    int t1 = (s0 - s4) * 4096;
+    o->x0 = t0 + t3;
+    o->x3 = t0 - t3;
+    o->x1 = t1 + t2;
+    o->x2 = t1 - t2;
+
+    t0 = s7; t1 = s5; t2 = s3; t3 = s1;
+    int p3 = t0 + t2;
+    int p4 = t1 + t3;
+    p1 = t0 + t3;
+    int p2 = t1 + t2;
+    int p5 = (p3 + p4) * JPEG_FIX(1.175875602);
+    t0 *= JPEG_FIX(0.298631336);
+    t1 *= JPEG_FIX(2.053119869);
+    t2 *= JPEG_FIX(3.072711026);
+    t3 *= JPEG_FIX(1.501321110);
+    p1 = p5 + p1 * JPEG_FIX(-0.899976223);
+    p2 = p5 + p2 * JPEG_FIX(-2.562915447);
+    p3 *= JPEG_FIX(-1.961570560);
+    p4 *= JPEG_FIX(-0.390180644);
+    o->t3 = t3 + p1 + p4;
+    o->t2 = t2 + p2 + p3;
+    o->t1 = t1 + p2 + p4;
+    o->t0 = t0 + p1 + p3;
+}
+
+static void jpeg_idct(const int* in, unsigned char* out, int outStride)
+{
+    int tmp[64];
+    JpegIdctOut o;
+
+    for (int c = 0; c < 8; c++) {
+        const int* d = in + c;
+        int* v = tmp + c;
+        if (!d[8] && !d[16] && !d[24] && !d[32] && !d[40] && !d[48] && !d[56]) {
+            int dc = d[0] * 4;
+            for (int r = 0; r < 8; r++) v[r * 8] = dc;
+            continue;
+        }
+        jpeg_idct_1d(d[0], d[8], d[16], d[24], d[32], d[40], d[48], d[56], &o);
+        o.x0 += 512; o.x1 += 512; o.x2 += 512; o.x3 += 512;
+        v[0]  = (o.x0 + o.t3) >> 10;
+        v[56] = (o.x0 - o.t3) >> 10;
+        v[8]  = (o.x1 + o.t2) >> 10;
+        v[48] = (o.x1 - o.t2) >> 10;
+        v[16] = (o.x2 + o.t1) >> 10;
+        v[40] = (o.x2 - o.t1) >> 10;
+        v[24] = (o.x3 + o.t0) >> 10;
+        v[32] = (o.x3 - o.t0) >> 10;
+    }
+
+    for (int r = 0; r < 8; r++) {
+        const int* v = tmp + r * 8;
+        unsigned char* dst = out + (size_t)r * outStride;
+        jpeg_idct_1d(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], &o);
+        // rounding and the +128 level shift, both at 1 << 17 scale
+        const int bias = 65536 + (128 << 17);
+        o.x0 += bias; o.x1 += bias; o.x2 += bias; o.x3 += bias;
+        dst[0] = jpeg_clamp((o.x0 + o.t3) >> 17);
+        dst[7] = jpeg_clamp((o.x0 - o.t3) >> 17);
+        dst[1] = jpeg_clamp((o.x1 + o.t2) >> 17);
+        dst[6] = jpeg_clamp((o.x1 - o.t2) >> 17);
+        dst[2] = jpeg_clamp((o.x2 + o.t1) >> 17);
+        dst[5] = jpeg_clamp((o.x2 - o.t1) >> 17);
+        dst[3] = jpeg_clamp((o.x3 + o.t0) >> 17);
+        dst[4] = jpeg_clamp((o.x3 - o.t0) >> 17);
+    }
+}
+
+static int jpeg_decode_block(JpegDecoder* jd, JpegComponent* c, unsigned char* out)
+{
+    int coef[64];
+    memset(coef, 0, sizeof(coef));
+    const uint16_t* q = jd->quant[c->quant];
+
+    int t = jpeg_huff_decode(jd, &jd->dc[c->dcTable]);
+    if (t < 0 || t > 11) return -1;
+    c->dcPred += jpeg_receive_extend(jd, t);
+    coef[0] = c->dcPred * q[0];
+
+    for (int k = 1; k < 64;) {
+        int rs = jpeg_huff_decode(jd, &jd->ac[c->acTable]);
+        if (rs < 0) return -1;
+        int run = rs >> 4;
+        int size = rs & 15;
+        if (size == 0) {
+            if (run != 15) break; // end of block
+            k += 16;
+            continue;
+        }
+        k += run;
+        if (k > 63) return -1;
+        coef[JPEG_ZIGZAG[k]] = jpeg_receive_extend(jd, size) * q[k];
+        k++;
+    }
+
+    jpeg_idct(coef, out, c->stride);
+    return 0;
+}
+
+// skip to the RSTn marker and restart the entropy decoder
+static int jpeg_restart(JpegDecoder* jd, JpegComponent** sc, int ns)
+{
+    if (!jd->marker) {
+        while (jd->cur + 1 < jd->end && !(jd->cur[0] == 0xFF && jd->cur[1] != 0 && jd->cur[1] != 0xFF)) jd->cur++;
+        if (jd->cur + 1 >= jd->end) return -1;
+        jd->marker = jd->cur[1];
+    }
+    if (jd->marker < 0xD0 || jd->marker > 0xD7) return -1;
+    jd->cur += 2;
+    jd->marker = 0;
+    jd->bits = 0;
+    jd->bitCount = 0;
+    for (int i = 0; i < ns; i++) sc[i]->dcPred = 0;
+    return 0;
+}
+
+static int jpeg_decode_scan(JpegDecoder* jd, JpegComponent** sc, int ns)
+{
+    jd->bits = 0;
+    jd->bitCount = 0;
+    jd->marker = 0;
+    for (int i = 0; i < ns; i++) sc[i]->dcPred = 0;
+
+    // a single-component scan is not interleaved: one block per "MCU"
+    int mcusX = ns == 1 ? (sc[0]->width + 7) / 8 : jd->mcusX;
+    int mcusY = ns == 1 ? (sc[0]->height + 7) / 8 : jd->mcusY;
+    int total = mcusX * mcusY;
+
+    for (int m = 0; m < total; m++) {
+        if (jd->restartInterval && m > 0 && m % jd->restartInterval == 0) {
+            if (jpeg_restart(jd, sc, ns) != 0) return -1;
+        }
+        int mx = m % mcusX;
+        int my = m / mcusX;
+        for (int i = 0; i < ns; i++) {
+            JpegComponent* c = sc[i];
+            int bw = ns == 1 ? 1 : c->h;
+            int bh = ns == 1 ? 1 : c->v;
+            for (int by = 0; by < bh; by++) {
+                for (int bx = 0; bx < bw; bx++) {
+                    int px = (mx * bw + bx) * 8;
+                    int py = (my * bh + by) * 8;
+                    if (jpeg_decode_block(jd, c, c->plane + (size_t)py * c->stride + px) != 0) return -1;
+                }
+            }
+        }
+    }
+
+    // leave cur on the marker that follows the scan
+    if (!jd->marker) {
+        while (jd->cur + 1 < jd->end && !(jd->cur[0] == 0xFF && jd->cur[1] != 0 && jd->cur[1] != 0xFF)) jd->cur++;
+    }
+    return 0;
+}
+
+static int jpeg_start_frame(JpegDecoder* jd, const unsigned char* seg, int segLen)
+{
+    if (segLen < 6 || seg[0] != 8) return -1;
+    jd->height = jpeg_u16(seg + 1);
+    jd->width = jpeg_u16(seg + 3);
+    jd->compCount = seg[5];
+    if (jd->width == 0 || jd->height == 0) return -1;
+    if ((jd->compCount != 1 && jd->compCount != 3) || segLen < 6 + 3 * jd->compCount) return -1;
+
+    jd->hMax = jd->vMax = 1;
+    for (int i = 0; i < jd->compCount; i++) {
+        JpegComponent* c = &jd->comp[i];
+        c->id = seg[6 + i * 3];
+        c->h = seg[7 + i * 3] >> 4;
+        c->v = seg[7 + i * 3] & 15;
+        c->quant = seg[8 + i * 3] & 3;
+        if (c->h < 1 || c->h > 4 || c->v < 1 || c->v > 4) return -1;
+        if (c->h > jd->hMax) jd->hMax = c->h;
+        if (c->v > jd->vMax) jd->vMax = c->v;
+    }
+    jd->mcusX = (jd->width + 8 * jd->hMax - 1) / (8 * jd->hMax);
+    jd->mcusY = (jd->height + 8 * jd->vMax - 1) / (8 * jd->vMax);
+
+    size_t needed = 0;
+    for (int i = 0; i < jd->compCount; i++) {
+        JpegComponent* c = &jd->comp[i];
+        c->width = (jd->width * c->h + jd->hMax - 1) / jd->hMax;
+        c->height = (jd->height * c->v + jd->vMax - 1) / jd->vMax;
+        c->stride = jd->mcusX * c->h * 8;
+        needed += (size_t)c->stride * (size_t)(jd->mcusY * c->v * 8);
+    }
+    if (needed > jd->planesSize) {
+        unsigned char* tmp = (unsigned char*)realloc(jd->planes, needed);
+        if (!tmp) return -1;
+        jd->planes = tmp;
+        jd->planesSize = needed;
+    }
+    unsigned char* p = jd->planes;
+    for (int i = 0; i < jd->compCount; i++) {
+        JpegComponent* c = &jd->comp[i];
+        c->plane = p;
+        p += (size_t)c->stride * (size_t)(jd->mcusY * c->v * 8);
+    }
+    return 0;
+}
+
+// Decodes a complete JFIF image into jd->comp[].plane. Returns 0 on success.
+static int jpeg_decode(JpegDecoder* jd, const unsigned char* data, size_t len)
+{
+    const unsigned char* p = data;
+    const unsigned char* end = data + len;
+    int haveFrame = 0;
+    int scanned = 0; // bit per component
+
+    jd->restartInterval = 0;
+    if (len < 2 || p[0] != 0xFF || p[1] != 0xD8) return -1;
+    p += 2;
+
+    for (;;) {
+        if (end - p < 2 || p[0] != 0xFF) return -1;
+        int marker = p[1];
+        p += 2;
+        if (marker == 0xFF) { p--; continue; } // fill byte
+        if (marker == 0xD9) break;               // EOI
+        if (marker >= 0xD0 && marker <= 0xD7) continue;
+
+        if (end - p < 2) return -1;
+        int segLen = jpeg_u16(p);
+        if (segLen < 2 || segLen > end - p) return -1;
+        const unsigned char* seg = p + 2;
+        const unsigned char* segEnd = p + segLen;
+        p = segEnd;
+
+        switch (marker) {
+            case 0xDB: // DQT
+                while (seg < segEnd) {
+                    int precision = seg[0] >> 4;
+                    int id = seg[0] & 3;
+                    seg++;
+                    if (segEnd - seg < (precision ? 128 : 64)) return -1;
+                    for (int i = 0; i < 64; i++) {
+                        jd->quant[id][i] = precision ? (uint16_t)jpeg_u16(seg + 2 * i) : seg[i];
+                    }
+                    seg += precision ? 128 : 64;
+                }
+                break;
+            case 0xC4: // DHT
+                while (seg < segEnd) {
+                    if (segEnd - seg < 17) return -1;
+                    int tableClass = seg[0] >> 4;
+                    int id = seg[0] & 3;
+                    int total = 0;
+                    for (int i = 0; i < 16; i++) total += seg[1 + i];
+                    if (total > 256 || segEnd - seg < 17 + total) return -1;
+                    JpegHuffman* hf = tableClass ? &jd->ac[id] : &jd->dc[id];
+                    if (jpeg_build_huffman(hf, seg + 1, seg + 17, total) != 0) return -1;
+                    seg += 17 + total;
+                }
+                break;
+            case 0xC0: // SOF0 baseline
+            case 0xC1: // SOF1 extended sequential, Huffman
+                if (jpeg_start_frame(jd, seg, (int)(segEnd - seg)) != 0) return -1;
+                haveFrame = 1;
+                break;
+            case 0xDD: // DRI
+                if (segEnd - seg < 2) return -1;
+                jd->restartInterval = jpeg_u16(seg);
+                break;
+            case 0xDA: { // SOS
+                if (!haveFrame || segEnd - seg < 1) return -1;
+                int ns = seg[0];
+                if (ns < 1 || ns > jd->compCount || segEnd - seg < 1 + 2 * ns) return -1;
+                JpegComponent* sc[JPEG_MAX_COMPONENTS];
+                for (int i = 0; i < ns; i++) {
+                    int id = seg[1 + 2 * i];
+                    int k = 0;
+                    while (k < jd->compCount && jd->comp[k].id != id) k++;
+                    if (k == jd->compCount) return -1;
+                    sc[i] = &jd->comp[k];
+                    sc[i]->dcTable = seg[2 + 2 * i] >> 4 & 3;
+                    sc[i]->acTable = seg[2 + 2 * i] & 3;
+                    scanned |= 1 << k;
+                }
+                jd->cur = segEnd;
+                jd->end = end;
+                if (jpeg_decode_scan(jd, sc, ns) != 0) return -1;
+                p = jd->cur;
+                break;
+            }
+            default:
+                if ((marker >= 0xC2 && marker <= 0xCF) && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+                    return -1; // progressive / lossless / arithmetic
+                }
+                break; // APPn, COM, ...
+        }
+    }
+
+    return haveFrame && scanned == (1 << jd->compCount) - 1 ? 0 : -1;
+}
+
+static void jpeg_decoder_free(JpegDecoder* jd)
+{
+    if (!jd) return;
+    free(jd->planes);
+    free(jd);
+}
+
+// Moves a decoded JPEG into the canvas planes at x/y. Chroma is resampled to
+// the planes' half resolution; for the usual 4:2:0 at even x/y that is a copy.
+static void canvas_put_jpeg(Canvas* canvas, const JpegDecoder* jd, int x, int y)
+{
+    CanvasPlanes* pl = canvas->planes;
+    int w = jd->width;
+    int h = jd->height;
+
+    const JpegComponent* luma = &jd->comp[0];
+    for (int row = 0; row < h; row++) {
+        memcpy(pl->y + (size_t)(y + row) * canvas->width + x, luma->plane + (size_t)row * luma->stride, (size_t)w);
+    }
+
+    int cx0 = x / 2, cx1 = (x + w - 1) / 2;
+    int cy0 = y / 2, cy1 = (y + h - 1) / 2;
+    for (int k = 1; k <= 2; k++) {
+        unsigned char* dstPlane = k == 1 ? pl->cb : pl->cr;
+        if (jd->compCount == 1) {
+            for (int cy = cy0; cy <= cy1; cy++) memset(dstPlane + (size_t)cy * pl->chromaWidth + cx0, 128, (size_t)(cx1 - cx0 + 1));
+            continue;
+        }
+        const JpegComponent* c = &jd->comp[k];
+        if (!(x & 1) && !(y & 1) && c->h * 2 == jd->hMax && c->v * 2 == jd->vMax) {
+            for (int cy = cy0; cy <= cy1; cy++) {
+                memcpy(dstPlane + (size_t)cy * pl->chromaWidth + cx0,
+                       c->plane + (size_t)(cy - cy0) * c->stride, (size_t)(cx1 - cx0 + 1));
+            }
+            continue;
+        }
+        // general case: average the samples under the 2x2 canvas pixels of
+        // each chroma texel that fall inside the rect
+        for (int cy = cy0; cy <= cy1; cy++) {
+            unsigned char* dst = dstPlane + (size_t)cy * pl->chromaWidth;
+            for (int cx = cx0; cx <= cx1; cx++) {
+                int sum = 0, n = 0;
+                for (int py = cy * 2; py < cy * 2 + 2; py++) {
+                    if (py < y || py >= y + h) continue;
+                    const unsigned char* src = c->plane + (size_t)((py - y) * c->v / jd->vMax) * c->stride;
+                    for (int px = cx * 2; px < cx * 2 + 2; px++) {
+                        if (px < x || px >= x + w) continue;
+                        sum += src[(px - x) * c->h / jd->hMax];
+                        n++;
+                    }
+                }
+                dst[cx] = (unsigned char)((sum + n / 2) / n);
+            }
+        }
+    }
+
+    canvas_mark_planes_dirty(canvas, x, y, w, h);
+}
+
+// ---------------- Tight (encoding 7) ----------------
+// Basic rects are spread over four independent zlib streams. Each stream
+// drains its queue as one task in the decode pool, so rects on different
+// streams inflate on different cores while the parser keeps reading the
+// socket; rects on the same stream stay in order because they share a
+// queue and only one drain task per stream exists at a time. Workers also run the
+// copy/palette/gradient filter and write the result into the canvas. RFB
+// lets rects of one update overlap, so the parser keeps the bounds of what
+// each stream still has queued and waits for the workers before a rect that
+// would land on those pixels from another stream or from its own thread.
+#define TIGHT_STREAMS          4
+#define TIGHT_FILL             0x08
+#define TIGHT_JPEG             0x09
+#define TIGHT_MAX_SUBENCODING  0x09
+#define TIGHT_EXPLICIT_FILTER  0x04
+#define TIGHT_FILTER_COPY      0
+#define TIGHT_FILTER_PALETTE   1
+#define TIGHT_FILTER_GRADIENT  2
+#define TIGHT_MIN_TO_COMPRESS  12
+
+// TPIXEL: 32bpp depth-24 true colour is sent as three bytes R, G, B.
+struct TPixelFormat {
+    int size;
+    int rgb24;
+    int redShift, greenShift, blueShift;
+    int redMax, greenMax, blueMax;
+    uint32_t fillBits; // bits outside the colour mask (set to 1)
+    int swap;          // server byte order differs from ours
+};
+
+static TPixelFormat tpixel_format(const PixelFormat* pf)
+{
+    TPixelFormat tf;
+    tf.rgb24 = pf->bitsPerPixel == 32 && pf->depth == 24 && pf->trueColour &&
+               pf->redMax == 255 && pf->greenMax == 255 && pf->blueMax == 255;
+    tf.size = tf.rgb24 ? 3 : pf->bitsPerPixel / 8;
+    tf.redShift = pf->redShift;
+    tf.greenShift = pf->greenShift;
+    tf.blueShift = pf->blueShift;
+    tf.fillBits = ~((255u << pf->redShift) | (255u << pf->greenShift) | (255u << pf->blueShift));
+    tf.redMax = pf->redMax;
+    tf.greenMax = pf->greenMax;
+    tf.blueMax = pf->blueMax;
+    tf.swap = host_big_endian() != pf->bigEndian;
+    return tf;
+}
+
+static inline uint32_t tpixel_pack_rgb(int r, int g, int b, const TPixelFormat* tf)
+{
+    uint32_t v = ((uint32_t)r << tf->redShift) | ((uint32_t)g << tf->greenShift) |
+                 ((uint32_t)b << tf->blueShift) | tf->fillBits;
+    if (tf->swap) {
+        v = (v >> 24) | ((v >> 8) & 0xFF00u) | ((v << 8) & 0xFF0000u) | (v << 24);
+    }
+    return v;
+}
+
+template <typename P>
+static inline P tpixel_load(const unsigned char* b, const TPixelFormat* tf)
+{
+    if (tf->rgb24) return (P)tpixel_pack_rgb(b[0], b[1], b[2], tf);
+    P p;
+    memcpy(&p, b, sizeof(P));
+    return p;
+}
+
+struct TightRect {
+    int x, y, w, h;
+    int filter;
+    int paletteSize;
+    unsigned char palette[256 * 4]; // raw TPIXELs
+};
+
+static size_t tight_raw_size(const TightRect* r, const TPixelFormat* tf)
+{
+    if (r->filter == TIGHT_FILTER_PALETTE) {
+        if (r->paletteSize == 2) return (size_t)((r->w + 7) / 8) * (size_t)r->h;
+        return (size_t)r->w * (size_t)r->h;
+    }
+    return (size_t)r->w * (size_t)r->h * (size_t)tf->size;
+}
+
+// Filtered Tight data -> canvas.
+template <typename P>
+static int tight_apply(Canvas* canvas, const TightRect* r, const unsigned char* data,
+                       const TPixelFormat* tf, int* gradientRow)
+{
+    const int rowPixels = canvas->stride / (int)sizeof(P);
+    P* rows = (P*)(canvas->pixels + (size_t)r->y * canvas->stride) + r->x;
+
+    if (r->filter == TIGHT_FILTER_COPY) {
+        for (int row = 0; row < r->h; row++) {
+            P* dst = rows + row * rowPixels;
+            if (!tf->rgb24) {
+                memcpy(dst, data, (size_t)r->w * sizeof(P));
+            } else {
+                for (int i = 0; i < r->w; i++) dst[i] = tpixel_load<P>(data + i * 3, tf);
+            }
+            data += (size_t)r->w * (size_t)tf->size;
+        }
+        return 0;
+    }
+
+    if (r->filter == TIGHT_FILTER_PALETTE) {
+        PaletteLut<P> lut;
+        lut.size = r->paletteSize;
+        for (int i = 0; i < r->paletteSize; i++) lut.entries[i] = tpixel_load<P>(r->palette + i * tf->size, tf);
+        for (int i = r->paletteSize; i < 256; i++) lut.entries[i] = lut.entries[0];
+        palette_prepare(&lut);
+
+        uint8_t idx[256];
+        for (int row = 0; row < r->h; row++) {
+            P* dst = rows + row * rowPixels;
+            if (r->paletteSize == 2) {
+                const unsigned char* bits = data + (size_t)row * (size_t)((r->w + 7) / 8);
+                for (int x0 = 0; x0 < r->w; x0 += 256) {
+                    int n = r->w - x0 < 256 ? r->w - x0 : 256;
+                    for (int i = 0; i < n; i++) {
+                        int bit = x0 + i;
+                        idx[i] = (uint8_t)((bits[bit >> 3] >> (7 - (bit & 7))) & 1);
+                    }
+                    palette_lookup(dst + x0, idx, n, &lut);
+                }
+            } else {
+                const unsigned char* src = data + (size_t)row * (size_t)r->w;
+                for (int x0 = 0; x0 < r->w; x0 += 256) {
+                    int n = r->w - x0 < 256 ? r->w - x0 : 256;
+                    palette_lookup(dst + x0, src + x0, n, &lut);
+                }
+            }
+        }
+        return 0;
+    }
+
+    if (r->filter == TIGHT_FILTER_GRADIENT && tf->rgb24) {
+        // gradientRow holds the previous row's R,G,B (w * 3 ints, starts at 0)
+        memset(gradientRow, 0, sizeof(int) * 3 * (size_t)r->w);
+        for (int row = 0; row < r->h; row++) {
+            P* dst = rows + row * rowPixels;
+            int left[3] = { 0, 0, 0 };
+            int upLeft[3] = { 0, 0, 0 };
+            for (int i = 0; i < r->w; i++) {
+                int px[3];
+                for (int c = 0; c < 3; c++) {
+                    int up = gradientRow[i * 3 + c];
+                    int est = left[c] + up - upLeft[c];
+                    if (est < 0) est = 0;
+                    if (est > 255) est = 255;
+                    px[c] = (data[c] + est) & 0xFF;
+                    upLeft[c] = up;
+                    left[c] = px[c];
+                    gradientRow[i * 3 + c] = px[c];
+                }
+                dst[i] = (P)tpixel_pack_rgb(px[0], px[1], px[2], tf);
+                data += 3;
+            }
+        }
+        return 0;
+    }
+
+    if (r->filter == TIGHT_FILTER_GRADIENT) {
+        // other formats predict on whole pixels, per colour field (row = w ints)
+        const int shift[3] = { tf->redShift, tf->greenShift, tf->blueShift };
+        const int max[3] = { tf->redMax, tf->greenMax, tf->blueMax };
+        memset(gradientRow, 0, sizeof(int) * (size_t)r->w);
+        for (int row = 0; row < r->h; row++) {
+            P* dst = rows + row * rowPixels;
+            uint32_t left = 0;
+            uint32_t upLeft = 0;
+            for (int i = 0; i < r->w; i++) {
+                P diff;
+                memcpy(&diff, data, sizeof(P));
+                data += sizeof(P);
+                uint32_t up = (uint32_t)gradientRow[i];
+                uint32_t px = 0;
+                for (int c = 0; c < 3; c++) {
+                    int est = (int)((left >> shift[c]) & max[c]) + (int)((up >> shift[c]) & max[c]) -
+                              (int)((upLeft >> shift[c]) & max[c]);
+                    if (est < 0) est = 0;
+                    if (est > max[c]) est = max[c];
+                    px |= ((((uint32_t)diff >> shift[c]) + (uint32_t)est) & (uint32_t)max[c]) << shift[c];
+                }
+                upLeft = up;
+                left = px;
+                gradientRow[i] = (int)px;
+                dst[i] = (P)px;
+            }
+        }
+        return 0;
+    }
+
+    return -1;
+}
+
+static int tight_apply_any(Canvas* canvas, const TightRect* r, const unsigned char* data,
+                           const TPixelFormat* tf, int** gradientRow, size_t* gradientRowSize)
+{
+    if (r->filter == TIGHT_FILTER_GRADIENT) {
+        size_t needed = sizeof(int) * 3 * (size_t)r->w;
+        if (*gradientRowSize < needed) {
+            int* tmp = (int*)realloc(*gradientRow, needed);
+            if (!tmp) return -1;
+            *gradientRow = tmp;
+            *gradientRowSize = needed;
+        }
+    }
+    switch (canvas->bytesPerPixel) {
+        case 1: return tight_apply<uint8_t>(canvas, r, data, tf, *gradientRow);
+        case 2: return tight_apply<uint16_t>(canvas, r, data, tf, *gradientRow);
+        case 4: return tight_apply<uint32_t>(canvas, r, data, tf, *gradientRow);
+    }
+    return -1;
+}
+
+template <typename P>
+static void tight_fill(Canvas* canvas, const TightRect* r, const TPixelFormat* tf)
+{
+    const int rowPixels = canvas->stride / (int)sizeof(P);
+    P* rows = (P*)(canvas->pixels + (size_t)r->y * canvas->stride) + r->x;
+    P p = tpixel_load<P>(r->palette, tf);
+    for (int row = 0; row < r->h; row++) fill_run(rows + row * rowPixels, p, r->w);
+}
+
+static int tight_fill_any(Canvas* canvas, const TightRect* r, const TPixelFormat* tf)
+{
+    switch (canvas->bytesPerPixel) {
+        case 1: tight_fill<uint8_t>(canvas, r, tf); return 0;
+        case 2: tight_fill<uint16_t>(canvas, r, tf); return 0;
+        case 4: tight_fill<uint32_t>(canvas, r, tf); return 0;
+    }
+    return -1;
+}
+
+// A large rect is queued in chunks as its bytes arrive: the first one carries
+// the rect (TIGHT_JOB_BEGIN), the last one applies the filter (TIGHT_JOB_END).
+#define TIGHT_JOB_BEGIN  1
+#define TIGHT_JOB_END    2
+#define TIGHT_CHUNK      8192 // smallest partial chunk worth a job
+
+struct TightJob {
+    TightJob* next;
+    int reset;            // inflateReset before using the stream
+    int flags;            // TIGHT_JOB_BEGIN / TIGHT_JOB_END
+    TightRect rect;       // with TIGHT_JOB_BEGIN
+    unsigned char* data;  // compressed bytes, none for a reset-only job
+    size_t dataLen;
+    size_t dataSize;      // allocated, kept when the job is recycled
+    size_t rawSize;       // with TIGHT_JOB_BEGIN
+};
+
+// Compressed rect whose remaining bytes still go to `stream` in chunks.
+struct TightFeed {
+    int stream;
+    size_t remaining;
+};
+
+// One zlib stream and the jobs queued on it. At most one drain task per
+// stream is in the decode pool at a time, which keeps the stream's jobs in
+// order on whichever worker runs it.
+struct TightStream {
+    struct TightPool* pool;
+    z_stream strm;
+    TightJob* head;
+    TightJob* tail;
+    int scheduled;        // a drain task is queued or running
+    unsigned char* out;
+    size_t outSize;
+    TightRect rect;       // rect being inflated chunk by chunk
+    int* gradientRow;
+    size_t gradientRowSize;
+};
+
+struct TightPool {
+    TightStream streams[TIGHT_STREAMS];
+    DecodePool* workers;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;  // pending dropped to zero or a drain task ended
+    int pending;
+    int failed;
+    TightJob* spare;      // finished jobs, reused with their data buffers
+    uint64_t inflateUs;
+    Canvas* canvas;
+    TPixelFormat tf;
+    DirtyRect queued[TIGHT_STREAMS]; // parser only: bounds of rects sent since the last wait
+};
+
+static int tight_run_job(TightStream* st, TightJob* job, uint64_t* inflateUs)
+{
+    TightPool* pool = st->pool;
+    if (job->reset) inflateReset(&st->strm);
+    if (!job->flags && !job->dataLen) return 0;
+
+    if (job->flags & TIGHT_JOB_BEGIN) {
+        if (st->outSize < job->rawSize) {
+            unsigned char* tmp = (unsigned char*)realloc(st->out, job->rawSize);
+            if (!tmp) return -1;
+            st->out = tmp;
+            st->outSize = job->rawSize;
+        }
+        st->strm.next_out  = (Bytef*)st->out;
+        st->strm.avail_out = (uInt)job->rawSize;
+        if (!(job->flags & TIGHT_JOB_END)) st->rect = job->rect;
+    }
+
+    uint64_t t0 = now_us();
+    st->strm.next_in   = (Bytef*)job->data;
+    st->strm.avail_in  = (uInt)job->dataLen;
+    int ret = inflate(&st->strm, Z_SYNC_FLUSH);
+    *inflateUs += now_us() - t0;
+    if (ret < 0 && ret != Z_BUF_ERROR) return -1;
+    if (!(job->flags & TIGHT_JOB_END)) return 0;
+    if (st->strm.avail_out != 0) return -1;
+
+    const TightRect* rect = job->flags & TIGHT_JOB_BEGIN ? &job->rect : &st->rect;
+    return tight_apply_any(pool->canvas, rect, st->out, &pool->tf,
+                           &st->gradientRow, &st->gradientRowSize);
+}
+
+// Decode pool task: runs the stream's jobs until its queue is empty.
+static void tight_stream_drain(void* arg)
+{
+    TightStream* st = (TightStream*)arg;
+    TightPool* pool = st->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (st->head) {
+        TightJob* job = st->head;
+        st->head = job->next;
+        if (!st->head) st->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        uint64_t inflateUs = 0;
+        int ret = tight_run_job(st, job, &inflateUs);
+
+        pthread_mutex_lock(&pool->lock);
+        job->next = pool->spare;
+        pool->spare = job;
+        pool->inflateUs += inflateUs;
+        if (ret != 0) pool->failed = 1;
+        if (--pool->pending == 0) pthread_cond_broadcast(&pool->idle);
+    }
+    st->scheduled = 0;
+    pthread_cond_broadcast(&pool->idle);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static TightPool* tight_pool_create(Canvas* canvas, DecodePool* workers)
+{
+    TightPool* pool = (TightPool*)calloc(1, sizeof(TightPool));
+    if (!pool) return NULL;
+    pool->canvas = canvas;
+    pool->tf = tpixel_format(&canvas->format);
+    pool->workers = workers;
+
+    int started = 0;
+    for (; started < TIGHT_STREAMS; started++) {
+        TightStream* st = &pool->streams[started];
+        st->pool = pool;
+        if (inflateInit(&st->strm) != Z_OK) break;
+    }
+    if (started < TIGHT_STREAMS) {
+        while (started-- > 0) inflateEnd(&pool->streams[started].strm);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    return pool;
+}
+
+static void tight_pool_submit(TightPool* pool, int stream, TightJob* job)
+{
+    TightStream* st = &pool->streams[stream];
+    job->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (st->tail) st->tail->next = job;
+    else st->head = job;
+    st->tail = job;
+    pool->pending++;
+    int schedule = !st->scheduled;
+    st->scheduled = 1;
+    pthread_mutex_unlock(&pool->lock);
+
+    // with every deque full the parser thread inflates it itself
+    if (schedule && decode_pool_submit(pool->workers, tight_stream_drain, st) != 0) tight_stream_drain(st);
+}
+
+// Waits for every queued rect; returns -1 if any of them failed to decode.
+static int tight_pool_wait(TightPool* pool, FrameTimings* timings)
+{
+    if (!pool) return 0;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) pthread_cond_wait(&pool->idle, &pool->lock);
+    int failed = pool->failed;
+    pool->failed = 0;
+    if (timings) {
+        timings->inflate_ms += us_to_ms(pool->inflateUs);
+        pool->inflateUs = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < TIGHT_STREAMS; i++) pool->queued[i].w = 0;
+    return failed ? -1 : 0;
+}
+
+// Parser side: waits for the workers if the rect overlaps anything still
+// queued on a stream other than `stream` (-1 = written on this thread, so
+// every stream counts), then records it against `stream`.
+static int tight_pool_claim(TightPool* pool, int stream, const TightRect* r)
+{
+    for (int i = 0; i < TIGHT_STREAMS; i++) {
+        const DirtyRect* q = &pool->queued[i];
+        if (i == stream || q->w == 0) continue;
+        if (r->x < q->x + q->w && q->x < r->x + r->w && r->y < q->y + q->h && q->y < r->y + r->h) {
+            if (tight_pool_wait(pool, NULL) != 0) return -1;
+            break;
+        }
+    }
+    if (stream < 0 || r->w <= 0 || r->h <= 0) return 0;
+
+    DirtyRect* q = &pool->queued[stream];
+    if (q->w == 0) {
+        q->x = r->x; q->y = r->y; q->w = r->w; q->h = r->h;
+        return 0;
+    }
+    int x1 = q->x + q->w > r->x + r->w ? q->x + q->w : r->x + r->w;
+    int y1 = q->y + q->h > r->y + r->h ? q->y + q->h : r->y + r->h;
+    if (r->x < q->x) q->x = r->x;
+    if (r->y < q->y) q->y = r->y;
+    q->w = x1 - q->x;
+    q->h = y1 - q->y;
+    return 0;
+}
+
+static void tight_pool_destroy(TightPool* pool)
+{
+    if (!pool) return;
+    // drain tasks still touch the pool until they clear `scheduled`
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < TIGHT_STREAMS; i++) {
+        while (pool->streams[i].scheduled) pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < TIGHT_STREAMS; i++) {
+        TightStream* st = &pool->streams[i];
+        inflateEnd(&st->strm);
+        free(st->out);
+        free(st->gradientRow);
+    }
+    while (pool->spare) {
+        TightJob* job = pool->spare;
+        pool->spare = job->next;
+        free(job->data);
+        free(job);
+    }
+    pthread_cond_destroy(&pool->idle);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+// Compact length: 1-3 bytes, 7 bits each, high bit = more bytes follow.
+// Returns how many bytes it took, 0 if they are not all buffered yet.
+static int compact_length(const unsigned char* p, size_t avail, size_t* len)
+{
+    *len = 0;
+    for (int i = 0; i < 3; i++) {
+        if ((size_t)i >= avail) return 0;
+        if (i < 2) {
+            *len |= (size_t)(p[i] & 0x7F) << (7 * i);
+            if (!(p[i] & 0x80)) return i + 1;
+        } else {
+            *len |= (size_t)p[i] << 14;
+        }
+    }
+    return 3;
+}
+
+// true if n bytes are available; otherwise n becomes what the caller waits for
+static inline int have_bytes(size_t avail, size_t n, size_t* need)
+{
+    *need = n;
+    return avail >= n;
+}
+
+// JPEG rects go straight to the canvas planes on the parser thread.
+static int tight_decode_jpeg(const unsigned char* data, size_t len, Canvas* canvas, RfbDecoders* dec,
+                             int x, int y, int w, int h)
+{
+    if (!dec->jpeg) {
+        dec->jpeg = (JpegDecoder*)calloc(1, sizeof(JpegDecoder));
+        if (!dec->jpeg) return -1;
+    }
+    JpegDecoder* jd = dec->jpeg;
+    if (canvas->bytesPerPixel != 4) return -1; // servers only use JPEG for 24-bit colour
+
+    if (jpeg_decode(jd, data, len) != 0 || jd->width != w || jd->height != h) return -1;
+    if (canvas_planes_init(canvas) != 0) return -1;
+    canvas_put_jpeg(canvas, jd, x, y);
+    return 0;
+}
+
+// Workers outlive the input buffer, so the compressed bytes are copied.
+// Jobs come back through pool->spare and keep their buffers, so once they
+// have grown to the largest rects of the session nothing is allocated.
+static TightJob* tight_job_new(TightPool* pool, const unsigned char* data, size_t len)
+{
+    pthread_mutex_lock(&pool->lock);
+    TightJob* job = pool->spare;
+    if (job) pool->spare = job->next;
+    pthread_mutex_unlock(&pool->lock);
+    if (!job) {
+        job = (TightJob*)calloc(1, sizeof(TightJob));
+        if (!job) return NULL;
+    }
+    if (job->dataSize < len) {
+        unsigned char* tmp = (unsigned char*)realloc(job->data, len);
+        if (!tmp) {
+            free(job->data);
+            free(job);
+            return NULL;
+        }
+        job->data = tmp;
+        job->dataSize = len;
+    }
+    job->next = NULL;
+    job->reset = 0;
+    job->flags = 0;
+    job->dataLen = len;
+    job->rawSize = 0;
+    if (len) memcpy(job->data, data, len);
+    return job;
+}
+
+// Takes one Tight rect out of `data` (avail buffered bytes). Nothing is
+// applied until the rect is there: until then it returns RFB_NEED_MORE with
+// *size set to the bytes it knows it needs. On success *size is what the
+// rect used. A compressed rect too big to wait for leaves with its first
+// chunk queued and feed->remaining > 0; tight_feed sends the rest.
+static int decode_tight(const unsigned char* data, size_t avail, size_t* size, Canvas* canvas,
+                        RfbDecoders* dec, TightFeed* feed, int x, int y, int w, int h)
+{
+    if (!dec->tight) {
+        if (!decoders_pool(dec)) return -1;
+        dec->tight = tight_pool_create(canvas, dec->workers);
+        if (!dec->tight) return -1;
+    }
+    TightPool* pool = dec->tight;
+    const TPixelFormat* tf = &pool->tf;
+
+    size_t n = 1;
+    if (!have_bytes(avail, n, size)) return RFB_NEED_MORE;
+    int control = data[0];
+    int comp = control >> 4;
+    int resetMask = control & 0x0F;
+
+    TightRect r;
+    r.x = x; r.y = y; r.w = w; r.h = h;
+    r.filter = TIGHT_FILTER_COPY;
+    r.paletteSize = 0;
+
+    int stream = comp & 0x03;
+    feed->remaining = 0;
+    const unsigned char* payload = NULL;
+    size_t payloadLen = 0;
+    size_t chunk = 0;
+    size_t rawSize = 0;
+
+    if (comp == TIGHT_FILL) {
+        n += (size_t)tf->size;
+        if (!have_bytes(avail, n, size)) return RFB_NEED_MORE;
+        memcpy(r.palette, data + 1, (size_t)tf->size);
+        stream = -1;
+    } else if (comp == TIGHT_JPEG) {
+        int k = compact_length(data + n, avail - n, &payloadLen);
+        if (!k) {
+            *size = avail + 1; // the length itself is cut off
+            return RFB_NEED_MORE;
+        }
+        n += (size_t)k;
+        payload = data + n;
+        n += payloadLen;
+        if (!have_bytes(avail, n, size)) return RFB_NEED_MORE;
+        stream = -1;
+    } else if (comp > TIGHT_MAX_SUBENCODING) {
+        return -1;
+    } else {
+        if (comp & TIGHT_EXPLICIT_FILTER) {
+            if (!have_bytes(avail, n + 1, size)) return RFB_NEED_MORE;
+            r.filter = data[n++];
+        }
+        if (r.filter == TIGHT_FILTER_PALETTE) {
+            if (!have_bytes(avail, n + 1, size)) return RFB_NEED_MORE;
+            r.paletteSize = data[n++] + 1;
+            size_t paletteBytes = (size_t)r.paletteSize * (size_t)tf->size;
+            if (!have_bytes(avail, n + paletteBytes, size)) return RFB_NEED_MORE;
+            memcpy(r.palette, data + n, paletteBytes);
+            n += paletteBytes;
+        } else if (r.filter != TIGHT_FILTER_COPY && r.filter != TIGHT_FILTER_GRADIENT) {
+            return -1;
+        }
+
+        rawSize = tight_raw_size(&r, tf);
+        if (rawSize < TIGHT_MIN_TO_COMPRESS) {
+            // sent uncompressed, bypasses the zlib stream entirely
+            payloadLen = rawSize;
+            stream = -1;
+        } else {
+            int k = compact_length(data + n, avail - n, &payloadLen);
+            if (!k) {
+                *size = avail + 1;
+                return RFB_NEED_MORE;
+            }
+            n += (size_t)k;
+        }
+        payload = data + n;
+        chunk = payloadLen;
+        if (stream >= 0 && avail - n < payloadLen) {
+            // a big rect goes to its worker in chunks as it arrives
+            chunk = avail - n;
+            if (chunk < TIGHT_CHUNK) {
+                *size = n + (payloadLen < TIGHT_CHUNK ? payloadLen : TIGHT_CHUNK);
+                return RFB_NEED_MORE;
+            }
+        }
+        n += chunk;
+        if (!have_bytes(avail, n, size)) return RFB_NEED_MORE;
+    }
+
+    // the whole rect (or its first chunk) is buffered from here on
+    if (tight_pool_claim(pool, stream, &r) != 0) return -1;
+    int resetPending[TIGHT_STREAMS];
+    for (int i = 0; i < TIGHT_STREAMS; i++) resetPending[i] = (resetMask >> i) & 1;
+
+    if (comp == TIGHT_FILL) {
+        if (tight_fill_any(canvas, &r, tf) != 0) return -1;
+    } else if (comp == TIGHT_JPEG) {
+        if (tight_decode_jpeg(payload, payloadLen, canvas, dec, x, y, w, h) != 0) return -1;
+    } else if (stream < 0) {
+        if (tight_apply_any(canvas, &r, payload, tf, &dec->tightGradientRow, &dec->tightGradientRowSize) != 0) {
+            return -1;
+        }
+    } else {
+        TightJob* job = tight_job_new(pool, payload, chunk);
+        if (!job) return -1;
+        job->flags = TIGHT_JOB_BEGIN | (chunk == payloadLen ? TIGHT_JOB_END : 0);
+        job->rect = r;
+        job->rawSize = rawSize;
+        feed->stream = stream;
+        feed->remaining = payloadLen - chunk;
+
+        // stream resets must stay in order with the jobs already queued there
+        job->reset = resetPending[stream];
+        resetPending[stream] = 0;
+        tight_pool_submit(pool, stream, job);
+    }
+    for (int i = 0; i < TIGHT_STREAMS; i++) {
+        if (!resetPending[i]) continue;
+        TightJob* resetJob = tight_job_new(pool, NULL, 0);
+        if (!resetJob) return -1;
+        resetJob->reset = 1;
+        tight_pool_submit(pool, i, resetJob);
+    }
+
+    if (comp != TIGHT_JPEG) canvas_mark_dirty(canvas, x, y, w, h);
+    return 0;
+}
+
+// Queues the next part of a streamed rect: everything buffered once it is
+// at least TIGHT_CHUNK or the rest of the rect. Returns 0 after the last
+// part, otherwise RFB_NEED_MORE with *need set; *used is what was queued.
+static int tight_feed(TightPool* pool, TightFeed* feed, const unsigned char* data, size_t avail,
+                      size_t* used, size_t* need)
+{
+    size_t chunk = avail < feed->remaining ? avail : feed->remaining;
+    *used = 0;
+    if (chunk == feed->remaining || chunk >= TIGHT_CHUNK) {
+        TightJob* job = tight_job_new(pool, data, chunk);
+        if (!job) return -1;
+        if (chunk == feed->remaining) job->flags = TIGHT_JOB_END;
+        tight_pool_submit(pool, feed->stream, job);
+        feed->remaining -= chunk;
+        *used = chunk;
+    }
+    if (feed->remaining == 0) return 0;
+    *need = feed->remaining < TIGHT_CHUNK ? feed->remaining : TIGHT_CHUNK;
+    return RFB_NEED_MORE;
+}
+
+// SetEncodings: type(1), pad(1), count(2), encodings(4 each)
+static int send_set_encodings(int sockfd, int compress, int quality)
+{
+    int32_t encodings[MAX_ENCODINGS + 4];
+    int total = 0;
+    for (int i = 0; i < preferredEncodingCount; i++) encodings[total++] = preferredEncodings[i];
+    if (compress >= 0 && compress <= 9) encodings[total++] = ENCODING_COMPRESS_LEVEL_0 + compress;
+    if (quality >= 0 && quality <= 9) encodings[total++] = ENCODING_QUALITY_LEVEL_0 + quality;
+    if (continuousUpdates) {
+        encodings[total++] = ENCODING_CONTINUOUS_UPDATES;
+        encodings[total++] = ENCODING_FENCE;
+    }
+
+    char msg[4 + 4 * (MAX_ENCODINGS + 4)];
+    int count = 0;
+    msg[0] = SET_ENCODINGS;
+    msg[1] = 0;
+    for (int i = 0; i < total; i++) {
+        char* p = msg + 4 + 4 * count++;
+        int32_t e = encodings[i];
+        p[0] = (char)((e >> 24) & 0xFF);
+        p[1] = (char)((e >> 16) & 0xFF);
+        p[2] = (char)((e >> 8) & 0xFF);
+        p[3] = (char)(e & 0xFF);
+    }
+    int16ToByteArray(count, msg + 2);
+    size_t len = 4 + 4 * (size_t)count;
+    return send(sockfd, msg, len, 0) == (ssize_t)len ? 0 : -1;
+}
+
+static void plane_copy(unsigned char* plane, int stride, int srcX, int srcY, int x, int y, int w, int h)
+{
+    const unsigned char* src = plane + (size_t)srcY * stride + srcX;
+    unsigned char* dst = plane + (size_t)y * stride + x;
+    if (y > srcY) {
+        for (int row = h - 1; row >= 0; row--) memmove(dst + (size_t)row * stride, src + (size_t)row * stride, (size_t)w);
+    } else {
+        for (int row = 0; row < h; row++) memmove(dst + (size_t)row * stride, src + (size_t)row * stride, (size_t)w);
+    }
+}
+
+// CopyRect over a canvas with JPEG planes: Y and the mask move exactly, chroma
+// moves at half resolution (an odd offset shifts it by half a texel).
+static int canvas_copy_planes(Canvas* canvas, int srcX, int srcY, int x, int y, int w, int h)
+{
+    CanvasPlanes* pl = canvas->planes;
+    plane_copy(pl->y, canvas->width, srcX, srcY, x, y, w, h);
+    plane_copy(pl->mask, canvas->width, srcX, srcY, x, y, w, h);
+
+    int cx0 = x / 2, cy0 = y / 2;
+    int cw = (x + w - 1) / 2 - cx0 + 1;
+    int ch = (y + h - 1) / 2 - cy0 + 1;
+    int scx0 = (srcX + (cx0 * 2 - x)) / 2;
+    int scy0 = (srcY + (cy0 * 2 - y)) / 2;
+    if (scx0 < 0) scx0 = 0;
+    if (scy0 < 0) scy0 = 0;
+    if (scx0 + cw > pl->chromaWidth) scx0 = pl->chromaWidth - cw;
+    if (scy0 + ch > pl->chromaHeight) scy0 = pl->chromaHeight - ch;
+    plane_copy(pl->cb, pl->chromaWidth, scx0, scy0, cx0, cy0, cw, ch);
+    plane_copy(pl->cr, pl->chromaWidth, scx0, scy0, cx0, cy0, cw, ch);
+
+    dirty_add(&canvas->dirty, x, y, w, h);
+    dirty_add(&pl->dirty, x, y, w, h);
+    dirty_add(&pl->maskDirty, x, y, w, h);
+    return 0;
+}
+
+// CopyRect: moves an area the client already has. Rows are copied bottom-up
+// when the destination is below the source so overlapping moves stay intact;
+// only the destination has to be re-uploaded to the texture.
+static int canvas_copy_rect(Canvas* canvas, int srcX, int srcY, int x, int y, int w, int h)
+{
+    if (srcX + w > canvas->width || srcY + h > canvas->height ||
+        x + w > canvas->width || y + h > canvas->height) {
+        return -1;
+    }
+    if (w == 0 || h == 0 || (srcX == x && srcY == y)) return 0;
+
+    size_t rowBytes = (size_t)w * (size_t)canvas->bytesPerPixel;
+    const char* src = canvas->pixels + (size_t)srcY * canvas->stride + (size_t)srcX * canvas->bytesPerPixel;
+    char* dst = canvas->pixels + (size_t)y * canvas->stride + (size_t)x * canvas->bytesPerPixel;
+    if (y > srcY) {
+        for (int row = h - 1; row >= 0; row--) {
+            memmove(dst + (size_t)row * canvas->stride, src + (size_t)row * canvas->stride, rowBytes);
+        }
+    } else {
+        for (int row = 0; row < h; row++) {
+            memmove(dst + (size_t)row * canvas->stride, src + (size_t)row * canvas->stride, rowBytes);
+        }
+    }
+    if (!canvas->planes) {
+        canvas_mark_dirty(canvas, x, y, w, h);
+        return 0;
+    }
+    return canvas_copy_planes(canvas, srcX, srcY, x, y, w, h);
+}
+
+// FramebufferUpdateRequest: type(1), incremental(1), x(2), y(2), w(2), h(2)
+static int send_update_request(int sockfd, const Canvas* canvas, int incremental)
+{
+    char msg[10];
+    msg[0] = FRAMEBUFFER_UPDATE_REQUEST;
+    msg[1] = (char)(incremental && incrementalUpdates ? 1 : 0);
+    int16ToByteArray(canvas->visible.x, msg + 2);
+    int16ToByteArray(canvas->visible.y, msg + 4);
+    int16ToByteArray(canvas->visible.w, msg + 6);
+    int16ToByteArray(canvas->visible.h, msg + 8);
+    return send(sockfd, msg, sizeof(msg), 0) == (ssize_t)sizeof(msg) ? 0 : -1;
+}
+
+// ---------------- Update flow ----------------
+// Requests are pipelined requestDepth updates ahead until the server answers
+// the ContinuousUpdates pseudo-encoding with EndOfContinuousUpdates; from then
+// on it pushes updates for the enabled area by itself and no requests are sent.
+// inFlight counts requests the server still owes an update for. It is only
+// topped up when an update arrives, so a slow client never queues more than
+// requestDepth updates at the server. Servers may merge requests, which only
+// makes the count err high and is corrected by the next update.
+struct UpdateFlow {
+    int continuous;
+    int inFlight;
+    UpdateFlow() : continuous(0), inFlight(0) {}
+};
+
+// EnableContinuousUpdates: type(1), enable(1), x(2), y(2), w(2), h(2)
+static int send_enable_continuous_updates(int sockfd, const Canvas* canvas, int enable)
+{
+    char msg[10];
+    msg[0] = (char)ENABLE_CONTINUOUS_UPDATES;
+    msg[1] = (char)(enable ? 1 : 0);
+    int16ToByteArray(canvas->visible.x, msg + 2);
+    int16ToByteArray(canvas->visible.y, msg + 4);
+    int16ToByteArray(canvas->visible.w, msg + 6);
+    int16ToByteArray(canvas->visible.h, msg + 8);
+    return send(sockfd, msg, sizeof(msg), 0) == (ssize_t)sizeof(msg) ? 0 : -1;
+}
+
+// Fence: type(1), pad(3), flags(4), length(1), payload(length <= 64)
+static int send_fence(int sockfd, uint32_t flags, const char* payload, int length)
+{
+    char msg[9 + 64];
+    memset(msg, 0, 4);
+    msg[0] = (char)CLIENT_FENCE;
+    msg[4] = (char)((flags >> 24) & 0xFF);
+    msg[5] = (char)((flags >> 16) & 0xFF);
+    msg[6] = (char)((flags >> 8) & 0xFF);
+    msg[7] = (char)(flags & 0xFF);
+    msg[8] = (char)length;
+    memcpy(msg + 9, payload, (size_t)length);
+    size_t len = 9 + (size_t)length;
+    return send(sockfd, msg, len, 0) == (ssize_t)len ? 0 : -1;
+}
+
+// SetScale: type(1), scale(1), pad(2). The server divides both dimensions
+// by `scale` and announces the new size as a DesktopSize rect.
+static int send_set_scale(int sockfd, int scale)
+{
+    char msg[4];
+    msg[0] = (char)SET_SCALE;
+    msg[1] = (char)scale;
+    msg[2] = 0;
+    msg[3] = 0;
+    return send(sockfd, msg, sizeof(msg), 0) == (ssize_t)sizeof(msg) ? 0 : -1;
+}
+
+// Largest divisor that still leaves the server framebuffer at least as many
+// pixels as the textured quad covers on the window, so scaling on the phone
+// only drops detail the cluster could not show anyway.
+static int server_scale_for(int width, int height)
+{
+    if (serverScale >= 0) return serverScale;
+    const int landscape = width > height;
+    const GLfloat* v = landscape ? landscapeVertices : portraitVertices;
+    const GLfloat* tc = landscape ? landscapeTexCoords : portraitTexCoords;
+    float x0 = v[0], x1 = v[0], y0 = v[1], y1 = v[1];
+    float u0 = tc[0], u1 = tc[0], t0 = tc[1], t1 = tc[1];
+    for (int i = 1; i < 4; i++) {
+        if (v[i * 3] < x0) x0 = v[i * 3];
+        if (v[i * 3] > x1) x1 = v[i * 3];
+        if (v[i * 3 + 1] < y0) y0 = v[i * 3 + 1];
+        if (v[i * 3 + 1] > y1) y1 = v[i * 3 + 1];
+        if (tc[i * 2] < u0) u0 = tc[i * 2];
+        if (tc[i * 2] > u1) u1 = tc[i * 2];
+        if (tc[i * 2 + 1] < t0) t0 = tc[i * 2 + 1];
+        if (tc[i * 2 + 1] > t1) t1 = tc[i * 2 + 1];
+    }
+    float quadW = (x1 - x0) * 0.5f * windowWidth;
+    float quadH = (y1 - y0) * 0.5f * windowHeight;
+    if (quadW < 1.0f || quadH < 1.0f) return 1;
+    int sx = (int)((u1 - u0) * width / quadW);
+    int sy = (int)((t1 - t0) * height / quadH);
+    int scale = sx < sy ? sx : sy;
+    if (scale < 1) return 1;
+    return scale > 255 ? 255 : scale;
+}
+
+// keep requestDepth incremental requests outstanding (request mode only)
+static int top_up_requests(int sockfd, const Canvas* canvas, UpdateFlow* flow)
+{
+    int depth = requestDepth < 1 ? 1 : requestDepth;
+    while (!flow->continuous && flow->inFlight < depth) {
+        if (send_update_request(sockfd, canvas, 1) != 0) return -1;
+        flow->inFlight++;
+    }
+    return 0;
+}
+
+// the whole visible area again, e.g. after a resize
+static int request_full_update(int sockfd, const Canvas* canvas, UpdateFlow* flow)
+{
+    if (flow->continuous) return send_enable_continuous_updates(sockfd, canvas, 1);
+    if (send_update_request(sockfd, canvas, 0) != 0) return -1;
+    flow->inFlight++;
+    return 0;
+}
+
+// ---------------- Adaptive compress / quality ----------------
+// Steers the CompressLevel and QualityLevel pseudo-encodings towards
+// targetFrameMs, each starting from its configured level; one left at -1
+// is never sent and not touched. The two step independently: a frame over
+// budget mostly in recv asks the server to squeeze harder and lowers the
+// JPEG quality, one over budget in decoding backs the compression off, and
+// with plenty of headroom the quality climbs back to jpegQuality. One step
+// per level at a time, at most once per CONTROLLER_HOLD_US, and only after
+// the averages settled on the new levels.
+#define CONTROLLER_EMA_ALPHA 0.1
+#define CONTROLLER_MIN_FRAMES 10
+#define CONTROLLER_HOLD_US 1000000ULL
+#define CONTROLLER_HEADROOM 0.6 // below this fraction of the target, raise quality
+
+struct EncodingController {
+    int compress; // -1 = not sent
+    int quality;  // -1 = not sent (no JPEG)
+    double recvEma;
+    double decodeEma;
+    double frameEma;
+    int frames;
+    uint64_t lastChangeUs;
+};
+
+static void encoding_controller_init(EncodingController* ec)
+{
+    memset(ec, 0, sizeof(*ec));
+    ec->compress = compressLevel;
+    ec->quality = jpegQuality >= 0 && jpegQuality <= 9 ? jpegQuality : -1;
+    ec->lastChangeUs = now_us();
+}
+
+// Feeds one drawn frame; sends SetEncodings when a level changes.
+static int encoding_controller_update(EncodingController* ec, const FrameTimings* t, int sockfd)
+{
+    if (targetFrameMs <= 0) return 0;
+
+    double recv = t->recv_ms;
+    double decode = t->parse_ms - t->wait_ms - t->recv_ms + t->texture_upload_ms;
+    if (decode < 0.0) decode = 0.0;
+    double frame = recv + decode;
+    if (ec->frames == 0) {
+        ec->recvEma = recv;
+        ec->decodeEma = decode;
+        ec->frameEma = frame;
+    } else {
+        ec->recvEma += CONTROLLER_EMA_ALPHA * (recv - ec->recvEma);
+        ec->decodeEma += CONTROLLER_EMA_ALPHA * (decode - ec->decodeEma);
+        ec->frameEma += CONTROLLER_EMA_ALPHA * (frame - ec->frameEma);
+    }
+    ec->frames++;
+
+    uint64_t now = now_us();
+    if (ec->frames < CONTROLLER_MIN_FRAMES || now - ec->lastChangeUs < CONTROLLER_HOLD_US) return 0;
+
+    int compress = ec->compress;
+    int quality = ec->quality;
+    if (ec->frameEma > targetFrameMs) {
+        if (ec->recvEma >= ec->decodeEma) {
+            if (compress >= 0 && compress < 9) compress++;
+            if (quality > 0) quality--;
+        } else if (compress > 1) {
+            compress--;
+        }
+    } else if (ec->frameEma < targetFrameMs * CONTROLLER_HEADROOM) {
+        if (quality >= 0 && quality < jpegQuality) quality++;
+    }
+    if (compress == ec->compress && quality == ec->quality) return 0;
+
+    printf("Frame %.1fms (recv %.1f, decode %.1f): compress %d, quality %d\n",
+           ec->frameEma, ec->recvEma, ec->decodeEma, compress, quality);
+    ec->compress = compress;
+    ec->quality = quality;
+    ec->frames = 0;
+    ec->lastChangeUs = now;
+    return send_set_encodings(sockfd, compress, quality);
+}
+
+// ---------------- Server message parser ----------------
+// A resumable state machine over RfbInput. rfb_receive appends whatever the
+// socket has without blocking; rfb_parse consumes complete items and returns
+// RFB_NEED_MORE where the data runs out, keeping its place for the next
+// call. Message and rect headers, Fence, CopyRect, screen lists and small
+// Tight rects are taken once they are buffered whole, straight out of the
+// buffer; TRLE, Hextile and Raw resume at the tile or row they stopped in;
+// Zlib, ZRLE and large Tight payloads go to inflate as they arrive; CutText
+// and colour map entries are dropped as they stream past. The buffer grows
+// to the largest single item and is reused. It is filled with one large
+// recv() per wakeup and only compacted when its free tail runs short, so a
+// whole update usually costs a handful of syscalls, not one per field.
+#define RFB_INPUT_CHUNK 65536
+#define RFB_INPUT_MIN_FREE (RFB_INPUT_CHUNK / 4) // compact below this much tail room
+
+#define RFB_MESSAGE    0 // message type
+#define RFB_RECT       1 // next rect header of a FramebufferUpdate, or its end
+#define RFB_RECT_BODY  2 // payload of the current rect
+#define RFB_SKIP       3 // rest of a message nobody needs
+
+struct RfbParser {
+    RfbInput in;
+    int state;
+    size_t need;      // bytes from in.rd the current item waits for
+    size_t skip;      // RFB_SKIP: bytes left to drop
+    int rectsLeft;
+    int x, y, w, h;   // current rect
+    int32_t encoding;
+    TileCursor tiles; // TRLE / Hextile tiles or Raw rows done so far
+    int started;      // Zlib / ZRLE: length read, data going into inflate
+    size_t remaining; // Zlib / ZRLE: compressed bytes still due
+    TightFeed tightFeed;
+};
+
+static void rfb_parser_init(RfbParser* p)
+{
+    memset(p, 0, sizeof(*p));
+    p->state = RFB_MESSAGE;
+}
+
+static void rfb_parser_free(RfbParser* p)
+{
+    free(p->in.buf);
+    memset(p, 0, sizeof(*p));
+}
+
+static inline const unsigned char* rfb_data(const RfbParser* p) { return p->in.buf + p->in.rd; }
+static inline size_t rfb_avail(const RfbParser* p) { return p->in.wr - p->in.rd; }
+static inline int rfb_have(RfbParser* p, size_t n) { return have_bytes(rfb_avail(p), n, &p->need); }
+static inline void rfb_consume(RfbParser* p, size_t n) { p->in.rd += n; }
+
+// Appends what the socket has without blocking. Returns the number of bytes
+// read, 0 if there was nothing, -1 on error or when the server closed.
+// *drained is set when the read came up short, i.e. the socket is empty and
+// the next recv() would only return EAGAIN.
+static int rfb_receive(int sockfd, RfbParser* p, FrameTimings* timings, int* drained)
+{
+    RfbInput* in = &p->in;
+    *drained = 0;
+    if (in->rd == in->wr) {
+        in->rd = in->wr = 0;
+    } else if (in->size - in->wr < RFB_INPUT_MIN_FREE || in->size - in->rd < p->need) {
+        memmove(in->buf, in->buf + in->rd, in->wr - in->rd);
+        in->wr -= in->rd;
+        in->rd = 0;
+    }
+    size_t wanted = p->need > RFB_INPUT_CHUNK ? p->need : RFB_INPUT_CHUNK;
+    if (in->size < wanted) {
+        unsigned char* tmp = (unsigned char*)realloc(in->buf, wanted);
+        if (!tmp) return -1;
+        in->buf = tmp;
+        in->size = wanted;
+    }
+    if (in->wr == in->size) return 0; // parser has not asked for more
+
+    size_t space = in->size - in->wr;
+    ssize_t r = recv_timed(sockfd, in->buf + in->wr, space, MSG_DONTWAIT, timings);
+    if (r == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    if (r < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    in->wr += (size_t)r;
+    *drained = (size_t)r < space;
+    return (int)r;
+}
+
+// Everything except FramebufferUpdate. Returns 0 once the message is
+// consumed (or handed to RFB_SKIP), RFB_NEED_MORE or -1.
+static int handle_server_message(int socket_fd, RfbParser* p, const Canvas* canvas, UpdateFlow* flow)
+{
+    const unsigned char* b = rfb_data(p);
+    unsigned char messageType = b[0];
+
+    if (messageType == MSG_END_OF_CONTINUOUS_UPDATES) {
+        rfb_consume(p, 1);
+        if (!flow->continuous && continuousUpdates) {
+            // first one = the server supports it; switch over
+            if (send_enable_continuous_updates(socket_fd, canvas, 1) != 0) return -1;
+            flow->continuous = 1;
+        } else if (flow->continuous) {
+            // server stopped pushing; back to requests
+            flow->continuous = 0;
+            flow->inFlight = 0;
+            if (top_up_requests(socket_fd, canvas, flow) != 0) return -1;
+        }
+        return 0;
+    }
+    if (messageType == MSG_SERVER_FENCE) {
+        // type(1), pad(3), flags(4), length(1), payload(length <= 64)
+        if (!rfb_have(p, 9)) return RFB_NEED_MORE;
+        int length = b[8];
+        if (length > 64) return -1;
+        if (!rfb_have(p, 9 + (size_t)length)) return RFB_NEED_MORE;
+        uint32_t flags = ((uint32_t)b[4] << 24) | ((uint32_t)b[5] << 16) | ((uint32_t)b[6] << 8) | (uint32_t)b[7];
+        // everything before this point is already applied, so the block flags
+        // hold trivially; echo the ones we understand
+        if (flags & FENCE_REQUEST) {
+            uint32_t reply = flags & (FENCE_BLOCK_BEFORE | FENCE_BLOCK_AFTER | FENCE_SYNC_NEXT);
+            if (send_fence(socket_fd, reply, (const char*)b + 9, length) != 0) return -1;
+        }
+        rfb_consume(p, 9 + (size_t)length);
+        return 0;
+    }
+    if (messageType == MSG_BELL) {
+        rfb_consume(p, 1);
+        return 0;
+    }
+    if (messageType == MSG_SERVER_CUT_TEXT) {
+        // type(1), pad(3), length(4), text(length)
+        if (!rfb_have(p, 8)) return RFB_NEED_MORE;
+        int32_t length = byteArrayToInt32((const char*)b + 4);
+        if (length < 0) return -1;
+        rfb_consume(p, 8);
+        p->skip = (size_t)length;
+        p->state = RFB_SKIP;
+        return 0;
+    }
+    if (messageType == MSG_SET_COLOUR_MAP_ENTRIES) {
+        // type(1), pad(1), first-colour(2), number-of-colours(2), 6 bytes each
+        if (!rfb_have(p, 6)) return RFB_NEED_MORE;
+        int count = (uint16_t)byteArrayToInt16((const char*)b + 4);
+        rfb_consume(p, 6);
+        p->skip = (size_t)count * 6;
+        p->state = RFB_SKIP;
+        return 0;
+    }
+    return -1; // unknown message, cannot stay in sync
+}
+
+// Payload of the current rect. Returns 0 once it is applied, RFB_NEED_MORE or -1.
+static int parse_rect_body(int socket_fd, RfbParser* p, Canvas* canvas, RfbDecoders* dec,
+                           UpdateFlow* flow, FrameTimings* timings)
+{
+    const unsigned char* b = rfb_data(p);
+    int x = p->x, y = p->y, w = p->w, h = p->h;
+    int32_t encoding = p->encoding;
+
+    if (encoding == ENCODING_DESKTOP_SIZE || encoding == ENCODING_EXTENDED_DESKTOP_SIZE) {
+        int accepted = 1;
+        if (encoding == ENCODING_EXTENDED_DESKTOP_SIZE) {
+            // x = reason, y = status; number-of-screens(1), pad(3), 16 bytes per screen
+            if (!rfb_have(p, 4)) return RFB_NEED_MORE;
+            size_t len = 4 + (size_t)b[0] * 16;
+            if (!rfb_have(p, len)) return RFB_NEED_MORE;
+            rfb_consume(p, len);
+            accepted = y == 0;
+        }
+        if (accepted && (w != canvas->width || h != canvas->height)) {
+            if (canvas_resize(canvas, w, h) != 0) return -1;
+            printf("Server framebuffer resized to %dx%d\n", w, h);
+            // the pipelined requests / enabled area covered the old size
+            (void)request_full_update(socket_fd, canvas, flow);
+        }
+        return 0;
+    }
+    if (encoding == ENCODING_COPYRECT) {
+        if (!rfb_have(p, 4)) return RFB_NEED_MORE;
+        int srcX = (uint16_t)byteArrayToInt16((const char*)b);
+        int srcY = (uint16_t)byteArrayToInt16((const char*)b + 2);
+        rfb_consume(p, 4);
+        return canvas_copy_rect(canvas, srcX, srcY, x, y, w, h);
+    }
+
+    if (encoding == ENCODING_POINTER_POS) {
+        CanvasCursor* cur = canvas_cursor(canvas);
+        if (!cur) return -1;
+        cur->x = x;
+        cur->y = y;
+        cur->positioned = 1;
+        return 0;
+    }
+    if (encoding == ENCODING_CURSOR) {
+        // x/y = hotspot
+        size_t len = (size_t)w * (size_t)h * (size_t)canvas->bytesPerPixel + (size_t)((w + 7) / 8) * (size_t)h;
+        if (!rfb_have(p, len)) return RFB_NEED_MORE;
+        int ret = canvas_set_cursor(canvas, x, y, w, h, b);
+        rfb_consume(p, len);
+        return ret;
+    }
+
+    // the rest carry pixels for x/y/w/h
+    if (x + w > canvas->width || y + h > canvas->height) return -1;
+
+    if (encoding == ENCODING_RAW) {
+        // whole rows as they arrive; tiles.tile counts the rows done
+        size_t rowBytes = (size_t)w * (size_t)canvas->bytesPerPixel;
+        while (p->tiles.tile < h) {
+            if (!rfb_have(p, rowBytes)) return RFB_NEED_MORE;
+            int rows = h - p->tiles.tile;
+            if (rowBytes > 0 && rfb_avail(p) / rowBytes < (size_t)rows) rows = (int)(rfb_avail(p) / rowBytes);
+            canvas_put_rect(canvas, x, y + p->tiles.tile, w, rows, (const char*)rfb_data(p));
+            rfb_consume(p, rowBytes * (size_t)rows);
+            p->tiles.tile += rows;
+        }
+        return 0;
+    }
+    if (encoding == ENCODING_TRLE) return decode_trle(&p->in, &p->tiles, &p->need, canvas, dec, x, y, w, h);
+    if (encoding == ENCODING_HEXTILE) return decode_hextile(&p->in, &p->tiles, &p->need, canvas, dec, x, y, w, h);
+    if (encoding == ENCODING_ZRLE || encoding == ENCODING_ZLIB) {
+        // length(4) + zlib data, inflated as it arrives
+        if (!p->started) {
+            if (!rfb_have(p, 4)) return RFB_NEED_MORE;
+            int32_t len = byteArrayToInt32((const char*)b);
+            if (len < 0) return -1;
+            rfb_consume(p, 4);
+            p->remaining = (size_t)len;
+            p->started = 1;
+            if (encoding == ENCODING_ZRLE) dec->zrleWindowFill = 0;
+            else zlib_rect_begin(dec, canvas, x, y, w, h);
+        }
+        size_t n = rfb_avail(p) < p->remaining ? rfb_avail(p) : p->remaining;
+        size_t used = 0;
+        int ret;
+        if (encoding == ENCODING_ZRLE) ret = decode_zrle(rfb_data(p), n, p->remaining, &used, canvas, dec, &p->tiles, x, y, w, h, timings);
+        else                           ret = decode_zlib(rfb_data(p), n, p->remaining, &used, canvas, dec, x, y, w, h, timings);
+        rfb_consume(p, used);
+        p->remaining -= used;
+        if (ret == RFB_NEED_MORE) p->need = 1;
+        return ret;
+    }
+    if (encoding == ENCODING_TIGHT) {
+        size_t size;
+        int ret;
+        if (p->tightFeed.remaining > 0) {
+            ret = tight_feed(dec->tight, &p->tightFeed, b, rfb_avail(p), &size, &p->need);
+            rfb_consume(p, size);
+            return ret;
+        }
+        ret = decode_tight(b, rfb_avail(p), &size, canvas, dec, &p->tightFeed, x, y, w, h);
+        if (ret == RFB_NEED_MORE) p->need = size;
+        if (ret != 0) return ret;
+        rfb_consume(p, size);
+        if (p->tightFeed.remaining == 0) return 0;
+        p->need = p->tightFeed.remaining < TIGHT_CHUNK ? p->tightFeed.remaining : TIGHT_CHUNK;
+        return RFB_NEED_MORE;
+    }
+    return -1; // unknown encoding, so its length is unknown too
+}
+
+// Parses buffered input until a FramebufferUpdate is complete (0), the
+// buffer runs dry (RFB_NEED_MORE) or the stream is broken (-1). Never reads
+// the socket; it only writes replies (requests, fences) to it.
+static int rfb_parse(int socket_fd, RfbParser* p, Canvas* canvas, RfbDecoders* dec,
+                     UpdateFlow* flow, FrameTimings* timings)
+{
+    for (;;) {
+        int ret = 0;
+        if (p->state == RFB_MESSAGE) {
+            if (!rfb_have(p, 1)) return RFB_NEED_MORE;
+            if (rfb_data(p)[0] != MSG_FRAMEBUFFER_UPDATE) {
+                ret = handle_server_message(socket_fd, p, canvas, flow);
+            } else if (rfb_have(p, 4)) {
+                // type(1), pad(1), rectcount(2)
+                p->rectsLeft = (uint16_t)byteArrayToInt16((const char*)rfb_data(p) + 2);
+                rfb_consume(p, 4);
+                p->state = RFB_RECT;
+
+                // --- PIPELINING: this answers one request; ask for more ASAP (not while the server pushes) ---
+                // best-effort; if it fails, we still try to decode current frame
+                if (flow->inFlight > 0) flow->inFlight--;
+                (void)top_up_requests(socket_fd, canvas, flow);
+            } else {
+                ret = RFB_NEED_MORE;
+            }
+        } else if (p->state == RFB_RECT) {
+            if (p->rectsLeft == 0) {
+                p->state = RFB_MESSAGE;
+                return tight_pool_wait(dec->tight, timings) != 0 ? -1 : 0;
+            }
+            // x(2), y(2), w(2), h(2), encoding(4)
+            if (!rfb_have(p, 12)) return RFB_NEED_MORE;
+            const char* hdr = (const char*)rfb_data(p);
+            p->x = (uint16_t)byteArrayToInt16(hdr + 0);
+            p->y = (uint16_t)byteArrayToInt16(hdr + 2);
+            p->w = (uint16_t)byteArrayToInt16(hdr + 4);
+            p->h = (uint16_t)byteArrayToInt16(hdr + 6);
+            p->encoding = byteArrayToInt32(hdr + 8);
+            rfb_consume(p, 12);
+            p->rectsLeft--;
+            p->tiles.tile = 0;
+            p->started = 0;
+            p->remaining = 0;
+            p->tightFeed.remaining = 0;
+            p->state = RFB_RECT_BODY;
+
+            // other encodings may overlap or read pixels Tight workers still own
+            if (p->encoding != ENCODING_TIGHT && tight_pool_wait(dec->tight, timings) != 0) return -1;
+        } else if (p->state == RFB_RECT_BODY) {
+            ret = parse_rect_body(socket_fd, p, canvas, dec, flow, timings);
+            if (ret == 0) p->state = RFB_RECT;
+        } else {
+            size_t n = rfb_avail(p) < p->skip ? rfb_avail(p) : p->skip;
+            rfb_consume(p, n);
+            p->skip -= n;
+            if (p->skip > 0) {
+                p->need = 1;
+                return RFB_NEED_MORE;
+            }
+            p->state = RFB_MESSAGE;
+        }
+        if (ret != 0) return ret;
+    }
+}
+
+// ---------------- VNC framebuffer update parser (PIPELINED) ----------------
+// Receives and parses whatever the socket has without blocking. Returns 0
+// when a FramebufferUpdate is complete (more may already be buffered, so
+// call again), RFB_NEED_MORE once the socket is drained, -1 on disconnect
+// or error. The parser keeps its place in between, even in the middle of a
+// message.
+static int rfb_pump(
+    int socket_fd,
+    Canvas* canvas,
+    RfbDecoders* dec,
+    UpdateFlow* flow,
+    RfbParser* parser,
+    FrameTimings* timings)
+{
+    int drained = 0;
+    for (;;) {
+        int ret = rfb_parse(socket_fd, parser, canvas, dec, flow, timings);
+        if (ret != RFB_NEED_MORE) return ret;
+
+        // after a short read go straight back to poll() instead of a recv()
+        // that can only fail with EAGAIN
+        if (drained) return RFB_NEED_MORE;
+        int got = rfb_receive(socket_fd, parser, timings, &drained);
+        if (got < 0) return -1;
+        if (got == 0) return RFB_NEED_MORE;
+    }
+}
+
+// ---------------- Event loop ----------------
+// One poll() over every descriptor a thread serves, plus one-shot and
+// periodic timers, so a slow source never blocks the others. Handlers run
+// on the loop's thread and must not block; sockets are read with
+// MSG_DONTWAIT. There are only ever a handful of timers, so they sit in a
+// flat array and the next deadline is found by scanning it.
+#define EVENT_MAX_FDS    8
+#define EVENT_MAX_TIMERS 8
+
+struct EventLoop;
+typedef void (*EventFdHandler)(EventLoop* loop, int fd, short revents, void* arg);
+typedef void (*EventTimerHandler)(EventLoop* loop, void* arg);
+
+struct EventTimer {
+    EventTimerHandler run; // NULL = free slot
+    void* arg;
+    uint64_t dueUs;
+    uint64_t periodUs;     // 0 = one-shot
+};
+
+struct EventLoop {
+    struct pollfd fds[EVENT_MAX_FDS];
+    EventFdHandler handlers[EVENT_MAX_FDS];
+    void* args[EVENT_MAX_FDS];
+    int fdCount;
+    EventTimer timers[EVENT_MAX_TIMERS];
+    int stop;
+    int failed;
+};
+
+static void event_loop_init(EventLoop* loop)
+{
+    memset(loop, 0, sizeof(*loop));
 }
 
-void execute_final_commands() {
-    struct Command commands[] = {
-        { "/eso/bin/apps/dmdt dc 70 33", "Create new display table with context 3 failed with error" },
-        { "/eso/bin/apps/dmdt sc 4 70",  "Set display 4 (VC) to display table 99 failed with error" }
-    };
-    size_t num_commands = sizeof(commands) / sizeof(commands[0]);
+// Watches fd for the life of the loop. Returns the slot, -1 when all are taken.
+static int event_loop_watch(EventLoop* loop, int fd, short events, EventFdHandler handler, void* arg)
+{
+    if (loop->fdCount == EVENT_MAX_FDS) return -1;
+    int i = loop->fdCount++;
+    loop->fds[i].fd = fd;
+    loop->fds[i].events = events;
+    loop->fds[i].revents = 0;
+    loop->handlers[i] = handler;
+    loop->args[i] = arg;
+    return i;
+}
 
-    for (size_t i = 0; i < num_commands; ++i) {
-        printf("Executing '%s'\n", commands[i].command);
-        int ret = system(commands[i].command);
-        if (ret != 0) fprintf(stderr, "%s: %d\n", commands[i].error_message, ret);
+// Returns the timer, -1 when all are taken.
+static int event_timer_start(EventLoop* loop, int delayMs, int periodMs, EventTimerHandler run, void* arg)
+{
+    for (int i = 0; i < EVENT_MAX_TIMERS; i++) {
+        EventTimer* t = &loop->timers[i];
+        if (t->run) continue;
+        t->run = run;
+        t->arg = arg;
+        t->dueUs = now_us() + (uint64_t)delayMs * 1000ULL;
+        t->periodUs = (uint64_t)periodMs * 1000ULL;
+        return i;
     }
+    return -1;
 }
 
-int16_t byteArrayToInt16(const char* byteArray) {
-    return (int16_t)(((unsigned char)byteArray[0] << 8) | (unsigned char)byteArray[1]);
+// Ends event_loop_run once the current handler returns; failed marks an error.
+static void event_loop_stop(EventLoop* loop, int failed)
+{
+    loop->stop = 1;
+    if (failed) loop->failed = 1;
 }
 
-int32_t byteArrayToInt32(const char* byteArray) {
-    return (int32_t)(
-        ((uint32_t)(unsigned char)byteArray[0] << 24) |
-        ((uint32_t)(unsigned char)byteArray[1] << 16) |
-        ((uint32_t)(unsigned char)byteArray[2] <<  8) |
-        ((uint32_t)(unsigned char)byteArray[3]      )
-    );
+static int event_loop_timeout_ms(const EventLoop* loop, uint64_t now)
+{
+    int timeout = -1;
+    for (int i = 0; i < EVENT_MAX_TIMERS; i++) {
+        const EventTimer* t = &loop->timers[i];
+        if (!t->run) continue;
+        if (t->dueUs <= now) return 0;
+        uint64_t ms = (t->dueUs - now + 999) / 1000;
+        if (timeout < 0 || ms < (uint64_t)timeout) timeout = ms > INT_MAX ? INT_MAX : (int)ms;
+    }
+    return timeout;
 }
 
-// ---------------- GL init ----------------
-static void compile_check(GLuint shader, const char* tag)
+static void event_loop_run_timers(EventLoop* loop)
 {
-    GLint ok = GL_FALSE;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
-    if (!ok) {
-        char infoLog[512];
-        glGetShaderInfoLog(shader, 512, NULL, infoLog);
-        printf("%s compile failed: %s\n", tag, infoLog);
+    uint64_t now = now_us();
+    for (int i = 0; i < EVENT_MAX_TIMERS && !loop->stop; i++) {
+        EventTimer* t = &loop->timers[i];
+        if (!t->run || t->dueUs > now) continue;
+        EventTimerHandler run = t->run;
+        void* arg = t->arg;
+        if (t->periodUs) {
+            t->dueUs += t->periodUs;
+            if (t->dueUs <= now) t->dueUs = now + t->periodUs; // skip missed ticks
+        } else {
+            t->run = NULL;
+        }
+        run(loop, arg);
     }
 }
 
-static void link_check(GLuint prog, const char* tag)
+// Dispatches until a handler stops the loop. Returns 0, or -1 if a handler
+// reported a failure or poll() itself failed.
+static int event_loop_run(EventLoop* loop)
 {
-    GLint ok = GL_FALSE;
-    glGetProgramiv(prog, GL_LINK_STATUS, &ok);
-    if (!ok) {
-        char infoLog[512];
-        glGetProgramInfoLog(prog, 512, NULL, infoLog);
-        printf("%s link failed: %s\n", tag, infoLog);
+    while (!loop->stop) {
+        int ready = poll(loop->fds, loop->fdCount, event_loop_timeout_ms(loop, now_us()));
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return -1;
+        }
+        for (int i = 0; i < loop->fdCount && ready > 0 && !loop->stop; i++) {
+            short revents = loop->fds[i].revents;
+            if (!revents) continue;
+            ready--;
+            loop->fds[i].revents = 0;
+            loop->handlers[i](loop, loop->fds[i].fd, revents, loop->args[i]);
+        }
+        event_loop_run_timers(loop);
     }
+    return loop->failed ? -1 : 0;
 }
 
-void Init() {
-    GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vs, 1, &vertexShaderSource, NULL);
-    glCompileShader(vs);
-    compile_check(vs, "VNC VS");
-
-    GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fs, 1, &fragmentShaderSource, NULL);
-    glCompileShader(fs);
-    compile_check(fs, "VNC FS");
-
-    GLuint vsT = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vsT, 1, &vertexShaderSourceText, NULL);
-    glCompileShader(vsT);
-    compile_check(vsT, "TXT VS");
-
-    GLuint fsT = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fsT, 1, &fragmentShaderSourceText, NULL);
-    glCompileShader(fsT);
-    compile_check(fsT, "TXT FS");
-
-    programObject = glCreateProgram();
-    glAttachShader(programObject, vs);
-    glAttachShader(programObject, fs);
-    glLinkProgram(programObject);
-    link_check(programObject, "VNC PROG");
+// ---------------- Frame handoff ----------------
+// The network thread parses into its own canvas and, at the end of every
+// FramebufferUpdate, publishes it into one of three snapshot canvases; the
+// GL thread uploads and draws the newest one. The slots rotate through one
+// atomic word (middle slot index | HANDOFF_FRESH), so neither side ever
+// waits for the other: the producer always owns a back slot to fill and the
+// consumer keeps its front slot until it swaps it for a fresher one. A slot
+// is only brought up to date where it is stale, and its dirty lists carry
+// everything changed since the last frame the GL thread is known to have
+// taken, so frames it skips lose no texture updates.
+#define HANDOFF_SLOTS 3
+#define HANDOFF_FRESH 4 // middle holds a frame the consumer has not taken
+
+// What one or more published frames changed.
+struct FrameChanges {
+    DirtyRegion pixels;
+    DirtyRegion planes; // Y/Cb/Cr, in canvas coordinates
+    DirtyRegion mask;
+    int cursorImage;
+    FrameChanges() : cursorImage(0) {}
+};
 
-    programObjectTextRender = glCreateProgram();
-    glAttachShader(programObjectTextRender, vsT);
-    glAttachShader(programObjectTextRender, fsT);
-    glLinkProgram(programObjectTextRender);
-    link_check(programObjectTextRender, "TXT PROG");
+struct FrameHandoff {
+    Canvas slots[HANDOFF_SLOTS];
+    volatile int middle;
+    int back;                            // producer only
+    int front;                           // consumer only
+    FrameChanges stale[HANDOFF_SLOTS];   // producer only: what each slot misses
+    FrameChanges sinceTaken;             // producer only: since the last frame known taken
+    volatile int done;                   // the network thread has ended
+    sem_t ready;                         // posted per publish and once at the end
+    volatile int uploadUs;               // texture upload time the network thread has not taken yet
+};
 
-	// Set clear color to black
-	glClearColor(
-    backgroundColor[0],
-    backgroundColor[1],
-    backgroundColor[2],
-    backgroundColor[3]);
+// full barriers: the slot contents are written before the index hands them over
+static int atomic_load_int(volatile int* p)
+{
+    return __sync_fetch_and_add(p, 0);
 }
 
-// ---------------- Text render (unchanged logic, minor fix for attrib program) ----------------
-void print_string(float x, float y, const char* text, float r, float g, float b, float size) {
-    (void)r; (void)g; (void)b; // shader is constant color in this example
-    char inputBuffer[2000] = { 0 };
-    GLfloat triangleBuffer[2000] = { 0 };
-    stb_easy_font_print(0, 0, (char*)text, NULL, inputBuffer, sizeof(inputBuffer));
-
-    float ndcMovementX = (2.0f * x) / windowWidth;
-    float ndcMovementY = (2.0f * y) / windowHeight;
-
-    int triangleIndex = 0;
-    for (int i = 0; i < (int)(sizeof(inputBuffer) / sizeof(GLfloat)); i += 8) {
-        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[i * sizeof(GLfloat)]) / size + ndcMovementX;
-        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 1) * sizeof(GLfloat)]) / size * -1 + ndcMovementY;
-        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 2) * sizeof(GLfloat)]) / size + ndcMovementX;
-        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 3) * sizeof(GLfloat)]) / size * -1 + ndcMovementY;
-        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 4) * sizeof(GLfloat)]) / size + ndcMovementX;
-        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 5) * sizeof(GLfloat)]) / size * -1 + ndcMovementY;
+static int atomic_exchange_int(volatile int* p, int value)
+{
+    int old;
+    do {
+        old = atomic_load_int(p);
+    } while (!__sync_bool_compare_and_swap(p, old, value));
+    return old;
+}
 
-        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[i * sizeof(GLfloat)]) / size + ndcMovementX;
-        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 1) * sizeof(GLfloat)]) / size * -1 + ndcMovementY;
-        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 4) * sizeof(GLfloat)]) / size + ndcMovementX;
-        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 5) * sizeof(GLfloat)]) / size * -1 + ndcMovementY;
-        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 6) * sizeof(GLfloat)]) / size + ndcMovementX;
-        triangleBuffer[triangleIndex++] = *reinterpret_cast<GLfloat*>(&inputBuffer[(i + 7) * sizeof(GLfloat)]) / size * -1 + ndcMovementY;
+static void dirty_merge(DirtyRegion* d, const DirtyRegion* src)
+{
+    if (src->full) d->full = 1;
+    for (int i = 0; i < src->count; i++) {
+        dirty_add(d, src->rects[i].x, src->rects[i].y, src->rects[i].w, src->rects[i].h);
     }
-
-    glUseProgram(programObjectTextRender);
-
-    GLuint vbo;
-    glGenBuffers(1, &vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(triangleBuffer), triangleBuffer, GL_STATIC_DRAW);
-
-    // FIX: query attribute from the TEXT program, not the VNC program
-    GLint positionAttribute = glGetAttribLocation(programObjectTextRender, "position");
-    glEnableVertexAttribArray(positionAttribute);
-    glVertexAttribPointer(positionAttribute, 2, GL_FLOAT, GL_FALSE, 0, NULL);
-
-    glDrawArrays(GL_TRIANGLES, 0, triangleIndex);
-
-    glDeleteBuffers(1, &vbo);
 }
 
-// ---------------- Config file helpers (unchanged) ----------------
-void parseLineArray(char *line, const char *key, GLfloat *dest, int count) {
-    if (strncmp(line, key, strlen(key)) == 0) {
-        char *values = strchr(line, '=');
-        if (values) {
-            values++;
-            for (int i = 0; i < count; i++) dest[i] = strtof(values, &values);
-        }
-    }
+static void changes_merge(FrameChanges* dst, const FrameChanges* src)
+{
+    dirty_merge(&dst->pixels, &src->pixels);
+    dirty_merge(&dst->planes, &src->planes);
+    dirty_merge(&dst->mask, &src->mask);
+    dst->cursorImage |= src->cursorImage;
 }
-void parseLineInt(char *line, const char *key, int *dest) {
-    if (strncmp(line, key, strlen(key)) == 0) {
-        char *value = strchr(line, '=');
-        if (value) *dest = atoi(value + 1);
+
+// moves the canvas' dirty lists into c
+static void changes_take(FrameChanges* c, Canvas* canvas)
+{
+    c->pixels = canvas->dirty;
+    canvas->dirty = DirtyRegion();
+    if (canvas->planes) {
+        c->planes = canvas->planes->dirty;
+        c->mask = canvas->planes->maskDirty;
+        canvas->planes->dirty = DirtyRegion();
+        canvas->planes->maskDirty = DirtyRegion();
     }
+    c->cursorImage = canvas->cursor && canvas->cursor->imageDirty;
+    if (canvas->cursor) canvas->cursor->imageDirty = 0;
 }
-void loadConfig(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        printf("Config file not found. Using defaults.\n");
+
+// copies the parts of one width x height plane named by d from src to dst
+static void plane_copy_region(char* dst, const char* src, int width, int height, int stride,
+                              int bytesPerPixel, const DirtyRegion* d, int chroma)
+{
+    if (d->full) {
+        memcpy(dst, src, (size_t)stride * (size_t)height);
         return;
     }
-    char line[256];
-    while (fgets(line, sizeof(line), file)) {
-        parseLineArray(line, "landscapeVertices", landscapeVertices, 12);
-        parseLineArray(line, "portraitVertices", portraitVertices, 12);
-        parseLineArray(line, "landscapeTexCoords", landscapeTexCoords, 8);
-        parseLineArray(line, "portraitTexCoords", portraitTexCoords, 8);
-        parseLineArray(line, "backgroundColor", backgroundColor, 4);
-        parseLineInt(line, "windowWidth", &windowWidth);
-        parseLineInt(line, "windowHeight", &windowHeight);
-    }
-    fclose(file);
-}
-void printArray(const char *label, GLfloat *array, int count, int elementsPerLine) {
-    printf("%s:\n", label);
-    for (int i = 0; i < count; i++) {
-        printf("%f ", array[i]);
-        if ((i + 1) % elementsPerLine == 0) printf("\n");
+    DirtyRect bounds = { 0, 0, width, height };
+    for (int i = 0; i < d->count; i++) {
+        DirtyRect r = d->rects[i];
+        if (chroma) rect_to_chroma(&r);
+        if (!rect_intersect(&r, &bounds)) continue;
+        size_t offset = (size_t)r.y * stride + (size_t)r.x * bytesPerPixel;
+        size_t rowBytes = (size_t)r.w * bytesPerPixel;
+        for (int row = 0; row < r.h; row++) {
+            memcpy(dst + offset, src + offset, rowBytes);
+            offset += stride;
+        }
     }
-    printf("\n");
 }
 
-// ---------------- VNC framebuffer update parser (PIPELINED) ----------------
-char* parseFramebufferUpdate_pipelined(
-    int socket_fd,
-    int* frameBufferWidth,
-    int* frameBufferHeight,
-    z_stream* strm,
-    int* finalHeight,
-    FrameTimings* timings)
+// Brings a slot up to date with the canvas where stale says it differs.
+static int frame_slot_sync(Canvas* slot, const Canvas* canvas, const FrameChanges* stale)
 {
-    uint64_t parseStart = now_us();
-
-    // Server->client message header: type(1), pad(1), rectcount(2)
-    char msgHdr[4];
-    if (recv_exact(socket_fd, msgHdr, 4, timings) != 0) {
-        return NULL;
+    FrameChanges all;
+    all.pixels.full = all.planes.full = all.mask.full = 1;
+    if (slot->width != canvas->width || slot->height != canvas->height) {
+        if (canvas_resize(slot, canvas->width, canvas->height) != 0) return -1;
+        stale = &all;
     }
-
-    unsigned char messageType = (unsigned char)msgHdr[0];
-    int rectCount = byteArrayToInt16(msgHdr + 2);
-
-    // --- PIPELINING: request NEXT update ASAP (after we know this is a framebuffer update) ---
-    if (messageType == 0) {
-        // best-effort; if it fails, we still try to decode current frame
-        (void)send(socket_fd, FRAMEBUFFER_UPDATE_REQUEST, sizeof(FRAMEBUFFER_UPDATE_REQUEST), 0);
+    if (!canvas->planes) canvas_planes_free(slot);
+    else if (!slot->planes && canvas_planes_init(slot) != 0) return -1;
+
+    plane_copy_region(slot->pixels, canvas->pixels, canvas->width, canvas->height, canvas->stride,
+                      canvas->bytesPerPixel, &stale->pixels, 0);
+    if (canvas->planes) {
+        const CanvasPlanes* src = canvas->planes;
+        CanvasPlanes* dst = slot->planes;
+        plane_copy_region((char*)dst->y, (const char*)src->y, canvas->width, canvas->height, canvas->width,
+                          1, &stale->planes, 0);
+        plane_copy_region((char*)dst->cb, (const char*)src->cb, src->chromaWidth, src->chromaHeight,
+                          src->chromaWidth, 1, &stale->planes, 1);
+        plane_copy_region((char*)dst->cr, (const char*)src->cr, src->chromaWidth, src->chromaHeight,
+                          src->chromaWidth, 1, &stale->planes, 1);
+        plane_copy_region((char*)dst->mask, (const char*)src->mask, canvas->width, canvas->height, canvas->width,
+                          1, &stale->mask, 0);
     }
 
-    int totalLoadedSize = 0;
-    char* finalFrameBuffer = (char*)malloc(1);
-    if (!finalFrameBuffer) return NULL;
-
-    int offset = 0;
-
-    for (int i = 0; i < rectCount; i++) {
-        // Rect header: x(2), y(2), w(2), h(2), encoding(4)
-        char rectHdr[12];
-        if (recv_exact(socket_fd, rectHdr, 12, timings) != 0) {
-            free(finalFrameBuffer);
-            return NULL;
+    if (canvas->cursor) {
+        const CanvasCursor* src = canvas->cursor;
+        CanvasCursor* dst = canvas_cursor(slot);
+        if (!dst) return -1;
+        if (stale->cursorImage) {
+            size_t bytes = (size_t)src->width * (size_t)src->height * 4;
+            if (bytes > dst->rgbaSize) {
+                unsigned char* tmp = (unsigned char*)realloc(dst->rgba, bytes);
+                if (!tmp) return -1;
+                dst->rgba = tmp;
+                dst->rgbaSize = bytes;
+            }
+            if (bytes) memcpy(dst->rgba, src->rgba, bytes);
+            dst->width = src->width;
+            dst->height = src->height;
+            dst->hotX = src->hotX;
+            dst->hotY = src->hotY;
         }
+        dst->x = src->x;
+        dst->y = src->y;
+        dst->positioned = src->positioned;
+    }
+    slot->visible = canvas->visible;
+    return 0;
+}
 
-        int w = byteArrayToInt16(rectHdr + 4);
-        int h = byteArrayToInt16(rectHdr + 6);
-        int32_t encoding = byteArrayToInt32(rectHdr + 8);
-
-        *frameBufferWidth = w;
-        *frameBufferHeight = h;
-        *finalHeight += h;
+static int frame_handoff_init(FrameHandoff* h, const Canvas* canvas)
+{
+    for (int i = 0; i < HANDOFF_SLOTS; i++) {
+        h->slots[i].format = canvas->format;
+        h->slots[i].bytesPerPixel = canvas->bytesPerPixel;
+        if (canvas_init(&h->slots[i], canvas->width, canvas->height) != 0) {
+            while (i-- > 0) canvas_free(&h->slots[i]);
+            return -1;
+        }
+        h->stale[i].pixels.full = 1;
+    }
+    h->front = 0;
+    h->middle = 1;
+    h->back = 2;
+    h->done = 0;
+    h->uploadUs = 0;
+    sem_init(&h->ready, 0, 0);
+    return 0;
+}
 
-        if (encoding == 6) { // ZLIB encoding
-            char sizeBuf[4];
-            if (recv_exact(socket_fd, sizeBuf, 4, timings) != 0) {
-                free(finalFrameBuffer);
-                return NULL;
-            }
+static void frame_handoff_free(FrameHandoff* h)
+{
+    for (int i = 0; i < HANDOFF_SLOTS; i++) canvas_free(&h->slots[i]);
+    sem_destroy(&h->ready);
+}
 
-            int compressedSize = byteArrayToInt32(sizeBuf);
-            if (compressedSize <= 0) {
-                free(finalFrameBuffer);
-                return NULL;
-            }
+// Network thread: hands the canvas' current state over to the GL thread.
+static int frame_handoff_publish(FrameHandoff* h, Canvas* canvas)
+{
+    FrameChanges frame;
+    changes_take(&frame, canvas);
+    for (int i = 0; i < HANDOFF_SLOTS; i++) changes_merge(&h->stale[i], &frame);
+    changes_merge(&h->sinceTaken, &frame);
+
+    Canvas* slot = &h->slots[h->back];
+    if (frame_slot_sync(slot, canvas, &h->stale[h->back]) != 0) return -1;
+    h->stale[h->back] = FrameChanges();
+    slot->dirty = h->sinceTaken.pixels;
+    if (slot->planes) {
+        slot->planes->dirty = h->sinceTaken.planes;
+        slot->planes->maskDirty = h->sinceTaken.mask;
+    }
+    if (slot->cursor) slot->cursor->imageDirty = h->sinceTaken.cursorImage;
 
-            char* compressedData = (char*)malloc((size_t)compressedSize);
-            if (!compressedData) {
-                free(finalFrameBuffer);
-                return NULL;
-            }
+    int old = atomic_exchange_int(&h->middle, h->back | HANDOFF_FRESH);
+    h->back = old & (HANDOFF_FRESH - 1);
+    if (!(old & HANDOFF_FRESH)) h->sinceTaken = frame; // the previous frame was taken
+    sem_post(&h->ready);
+    return 0;
+}
 
-            if (recv_exact(socket_fd, compressedData, (size_t)compressedSize, timings) != 0) {
-                free(compressedData);
-                free(finalFrameBuffer);
-                return NULL;
-            }
+// GL thread: the newest published frame if there is one it has not taken
+// yet, otherwise NULL. The slot stays the consumer's until the next take.
+static Canvas* frame_handoff_take(FrameHandoff* h)
+{
+    if (!(atomic_load_int(&h->middle) & HANDOFF_FRESH)) return NULL;
+    int old = atomic_exchange_int(&h->middle, h->front);
+    h->front = old & (HANDOFF_FRESH - 1);
+    return &h->slots[h->front];
+}
 
-            size_t outSize = (size_t)w * (size_t)h * 4u;
-            char* decompressedData = (char*)malloc(outSize);
-            if (!decompressedData) {
-                free(compressedData);
-                free(finalFrameBuffer);
-                return NULL;
-            }
+// GL thread: what uploading a taken frame's damage cost.
+static void frame_handoff_uploaded(FrameHandoff* h, uint64_t us)
+{
+    __sync_fetch_and_add(&h->uploadUs, (int)us);
+}
 
-            totalLoadedSize += (int)outSize;
-            char* tmp = (char*)realloc(finalFrameBuffer, (size_t)totalLoadedSize);
-            if (!tmp) {
-                free(decompressedData);
-                free(compressedData);
-                free(finalFrameBuffer);
-                return NULL;
-            }
-            finalFrameBuffer = tmp;
+// Network thread: upload time reported since the last call. It trails the
+// frames it belongs to by one draw, which the controller's averages absorb.
+static double frame_handoff_upload_ms(FrameHandoff* h)
+{
+    return us_to_ms((uint64_t)atomic_exchange_int(&h->uploadUs, 0));
+}
 
-            strm->avail_in  = (uInt)compressedSize;
-            strm->next_in   = (Bytef*)compressedData;
-            strm->avail_out = (uInt)outSize;
-            strm->next_out  = (Bytef*)decompressedData;
+// Everything the network thread needs for one connection.
+struct NetworkSession {
+    pthread_t thread;
+    int sockfd;
+    Canvas* canvas;
+    RfbDecoders* decoders;
+    RfbParser* parser;
+    UpdateFlow* flow;
+    EncodingController* controller;
+    FrameHandoff* handoff;
+    int frames; // published so far
+    FrameTimings timings;  // update being received
+    uint64_t frameStartUs; // previous update published
+    uint64_t idleSinceUs;  // last return to poll()
+    int between;           // parser waits for the first byte of a message
+    FrameTimings stats;    // sums since the last statsInterval tick
+    int statsFrames;
+};
 
-            uint64_t infStart = now_us();
-            int ret = inflate(strm, Z_NO_FLUSH);
-            uint64_t infEnd = now_us();
-            if (timings) timings->inflate_ms += us_to_ms(infEnd - infStart);
+// VNC socket readable: parse everything it has, publishing each finished
+// update. Time spent in poll() counts as wait while the parser sits
+// between messages, as recv once an update has started arriving.
+static void network_on_vnc(EventLoop* loop, int fd, short revents, void* arg)
+{
+    (void)revents;
+    NetworkSession* s = (NetworkSession*)arg;
+    uint64_t now = now_us();
+    if (s->between) s->timings.wait_ms += us_to_ms(now - s->idleSinceUs);
+    else            s->timings.recv_ms += us_to_ms(now - s->idleSinceUs);
 
-            if (ret < 0 && ret != Z_BUF_ERROR) {
-                free(decompressedData);
-                free(compressedData);
-                free(finalFrameBuffer);
-                return NULL;
-            }
+    for (;;) {
+        int ret = rfb_pump(fd, s->canvas, s->decoders, s->flow, s->parser, &s->timings);
+        if (ret < 0) {
+            perror("rfb_pump");
+            event_loop_stop(loop, 1);
+            return;
+        }
+        if (ret == RFB_NEED_MORE) break;
+
+        s->timings.parse_ms = us_to_ms(now_us() - s->frameStartUs);
+        s->timings.texture_upload_ms = frame_handoff_upload_ms(s->handoff);
+        if (frame_handoff_publish(s->handoff, s->canvas) != 0) {
+            fprintf(stderr, "Out of memory publishing a frame\n");
+            event_loop_stop(loop, 1);
+            return;
+        }
+        s->frames++;
+        s->stats.wait_ms += s->timings.wait_ms;
+        s->stats.recv_ms += s->timings.recv_ms;
+        s->stats.inflate_ms += s->timings.inflate_ms;
+        s->stats.parse_ms += s->timings.parse_ms;
+        s->stats.texture_upload_ms += s->timings.texture_upload_ms;
+        s->statsFrames++;
+        (void)encoding_controller_update(s->controller, &s->timings, s->sockfd);
+        s->timings = FrameTimings();
+        s->frameStartUs = now_us();
+    }
+    s->between = s->parser->state == RFB_MESSAGE && rfb_avail(s->parser) == 0;
+    s->idleSinceUs = now_us();
+}
 
-            memcpy(finalFrameBuffer + offset, decompressedData, outSize);
-            offset += (int)outSize;
+// statsInterval timer: per-frame averages of the network side.
+static void network_on_stats(EventLoop* loop, void* arg)
+{
+    (void)loop;
+    NetworkSession* s = (NetworkSession*)arg;
+    if (s->statsFrames > 0) {
+        double n = (double)s->statsFrames;
+        printf("Network: %d frames, wait %.1fms, recv %.1fms, inflate %.1fms, parse %.1fms, upload %.1fms\n",
+               s->statsFrames, s->stats.wait_ms / n, s->stats.recv_ms / n,
+               s->stats.inflate_ms / n, s->stats.parse_ms / n, s->stats.texture_upload_ms / n);
+    }
+    s->stats = FrameTimings();
+    s->statsFrames = 0;
+}
 
-            free(decompressedData);
-            free(compressedData);
-        } else {
-            // Unsupported encoding in this minimal example
-            // You could skip/handle RAW etc. here.
-        }
+// Receives, decodes and publishes until the connection fails.
+static void* network_thread_main(void* arg)
+{
+    NetworkSession* s = (NetworkSession*)arg;
+    EventLoop loop;
+    event_loop_init(&loop);
+    s->between = 1;
+    s->frameStartUs = s->idleSinceUs = now_us();
+    s->statsFrames = 0;
+    if (event_loop_watch(&loop, s->sockfd, POLLIN, network_on_vnc, s) >= 0) {
+        if (statsInterval > 0) event_timer_start(&loop, statsInterval, statsInterval, network_on_stats, s);
+        event_loop_run(&loop);
     }
+    atomic_exchange_int(&s->handoff->done, 1);
+    sem_post(&s->handoff->ready);
+    return NULL;
+}
 
-    uint64_t parseEnd = now_us();
-    if (timings) timings->parse_ms = us_to_ms(parseEnd - parseStart);
-    return finalFrameBuffer;
+// ---------------- Reconnect backoff ----------------
+// Pause before the next connection attempt: RECONNECT_MIN_DELAY_MS, doubled
+// for every attempt in a row that failed, up to RECONNECT_MAX_DELAY_MS. A
+// session that got a frame through starts the count over. Only a failed
+// attempt gives the display back to the stock HMI, so a link that drops and
+// comes straight back keeps our table instead of switching dmdt each time.
+#define RECONNECT_MIN_DELAY_MS 200
+#define RECONNECT_MAX_DELAY_MS 5000
+
+static void reconnect_backoff(int* failures)
+{
+    int delayMs = RECONNECT_MIN_DELAY_MS;
+    for (int i = 0; i < *failures && delayMs < RECONNECT_MAX_DELAY_MS; i++) delayMs *= 2;
+    if (delayMs > RECONNECT_MAX_DELAY_MS) delayMs = RECONNECT_MAX_DELAY_MS;
+    (*failures)++;
+    display_request(DISPLAY_STOCK, 0);
+    usleep(delayMs * 1000);
 }
 
 // ---------------- MAIN ----------------
@@ -547,6 +5139,18 @@ int main(int argc, char* argv[])
     printArray("Background color", backgroundColor, 4, 4);
     printf("windowWidth = %d;\n", windowWidth);
     printf("windowHeight = %d;\n", windowHeight);
+    printf("encodings =");
+    for (int i = 0; i < preferredEncodingCount; i++) printf(" %d", preferredEncodings[i]);
+    printf("\n");
+    printf("jpegQuality = %d;\n", jpegQuality);
+    printf("pixelFormat = %d;\n", pixelFormatBits);
+    printf("continuousUpdates = %d;\n", continuousUpdates);
+    printf("requestDepth = %d;\n", requestDepth);
+    printf("compressLevel = %d;\n", compressLevel);
+    printf("targetFrameMs = %d;\n", targetFrameMs);
+    printf("serverScale = %d;\n", serverScale);
+    printf("decodeThreads = %d;\n", decodeThreads);
+    printf("statsInterval = %d;\n", statsInterval);
 
     // display_init
     void* func_handle = dlopen("libdisplayinit.so", RTLD_LAZY);
@@ -643,10 +5247,13 @@ int main(int argc, char* argv[])
 
     Init();
 
+    // servers that do not know SetScale drop the connection; ask only once
+    int scaleRejected = 0;
+    int reconnectFailures = 0;
+
     // -------- Main reconnect loop --------
     for (;;) {
         printf("Main loop executed\n");
-        execute_final_commands();
 
         int sockfd = -1;
         fd_set write_fds;
@@ -661,7 +5268,7 @@ int main(int argc, char* argv[])
         sockfd = socket(AF_INET, SOCK_STREAM, 0);
         if (sockfd < 0) {
             perror("Error opening socket");
-            usleep(200000);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
 
@@ -679,14 +5286,14 @@ int main(int argc, char* argv[])
         if (setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive)) < 0) {
             perror("setsockopt SO_KEEPALIVE");
             close(sockfd);
-            usleep(200000);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
 
         if (setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPALIVE, &keepidle, sizeof(keepidle)) < 0) {
             perror("setsockopt TCP_KEEPALIVE");
             close(sockfd);
-            usleep(200000);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
 
@@ -694,13 +5301,13 @@ int main(int argc, char* argv[])
         if (flags < 0) {
             perror("fcntl F_GETFL");
             close(sockfd);
-            usleep(200000);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
         if (fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
             perror("fcntl F_SETFL");
             close(sockfd);
-            usleep(200000);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
 
@@ -721,7 +5328,7 @@ int main(int argc, char* argv[])
         if (result < 0 && errno != EINPROGRESS) {
             perror("Error connecting to server");
             close(sockfd);
-            usleep(200000);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
 
@@ -735,14 +5342,14 @@ int main(int argc, char* argv[])
             if (result < 0) perror("select failed");
             else printf("Connection timed out\n");
             close(sockfd);
-            usleep(200000);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
 
         if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &so_error, &len) < 0 || so_error != 0) {
             printf("Connection failed: %s\n", strerror(so_error));
             close(sockfd);
-            usleep(200000);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
 
@@ -750,23 +5357,23 @@ int main(int argc, char* argv[])
         if (fcntl(sockfd, F_SETFL, flags) < 0) {
             perror("fcntl F_SETFL");
             close(sockfd);
-            usleep(200000);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
 
-        execute_initial_commands();
-
         // ---- VNC handshake (same behavior as your original) ----
         char serverInitMsg[12];
         if (recv_exact(sockfd, serverInitMsg, sizeof(serverInitMsg), NULL) != 0) {
             perror("recv serverInitMsg");
             close(sockfd);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
 
         if (send(sockfd, PROTOCOL_VERSION, strlen(PROTOCOL_VERSION), 0) < 0) {
             perror("send PROTOCOL_VERSION");
             close(sockfd);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
 
@@ -774,30 +5381,49 @@ int main(int argc, char* argv[])
         if (recv(sockfd, securityHandshake, sizeof(securityHandshake), 0) <= 0) {
             perror("recv securityHandshake");
             close(sockfd);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
 
         if (send(sockfd, "\x01", 1, 0) < 0) {
             perror("send ClientInit");
             close(sockfd);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
 
-        // Read framebuffer w/h (2+2), then pixel format(16) + name length(4) + name(nameLen)
-        char fbWb[2], fbHb[2];
-        if (recv_exact(sockfd, fbWb, 2, NULL) != 0 || recv_exact(sockfd, fbHb, 2, NULL) != 0) {
-            perror("recv fb size");
+        // ServerInit: framebuffer w/h (2+2), pixel format(16), name length(4), then name(nameLen)
+        char serverInit[24];
+        if (recv_exact(sockfd, serverInit, sizeof(serverInit), NULL) != 0) {
+            perror("recv ServerInit");
             close(sockfd);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
+        const char* fbWb = serverInit;
+        const char* fbHb = serverInit + 2;
+        const char* pixelFormat = serverInit + 4;
+        const char* nameLength = serverInit + 20;
+
+        // the canvas is kept in the format we ask for, not the server's
+        Canvas canvas;
+        PixelFormat serverFormat;
+        parse_pixel_format(pixelFormat, &serverFormat);
+        printf("Server pixel format: %d bpp, depth %d\n", serverFormat.bitsPerPixel, serverFormat.depth);
+        if (client_pixel_format(pixelFormatBits, &canvas.format) != 0) {
+            fprintf(stderr, "Unsupported pixelFormat %d, using 32\n", pixelFormatBits);
+            client_pixel_format(32, &canvas.format);
+        }
+        canvas.bytesPerPixel = canvas.format.bitsPerPixel / 8;
 
-        char pixelFormat[16];
-        char nameLength[4];
-        if (recv_exact(sockfd, pixelFormat, 16, NULL) != 0 || recv_exact(sockfd, nameLength, 4, NULL) != 0) {
-            perror("recv pixelFormat/nameLength");
+        if (canvas_init(&canvas, (uint16_t)byteArrayToInt16(fbWb), (uint16_t)byteArrayToInt16(fbHb)) != 0) {
+            fprintf(stderr, "Invalid framebuffer size %dx%d\n",
+                    (uint16_t)byteArrayToInt16(fbWb), (uint16_t)byteArrayToInt16(fbHb));
             close(sockfd);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
+        printf("Server framebuffer %dx%d, client format %d bpp\n", canvas.width, canvas.height, canvas.format.bitsPerPixel);
 
         uint32_t nameLengthInt =
             ((uint32_t)(unsigned char)nameLength[0] << 24) |
@@ -807,11 +5433,18 @@ int main(int argc, char* argv[])
 
         if (nameLengthInt > 0) {
             char* name = (char*)malloc(nameLengthInt + 1);
-            if (!name) { close(sockfd); continue; }
+            if (!name) {
+                canvas_free(&canvas);
+                close(sockfd);
+                reconnect_backoff(&reconnectFailures);
+                continue;
+            }
             if (recv_exact(sockfd, name, nameLengthInt, NULL) != 0) {
                 free(name);
                 perror("recv server name");
+                canvas_free(&canvas);
                 close(sockfd);
+                reconnect_backoff(&reconnectFailures);
                 continue;
             }
             name[nameLengthInt] = 0;
@@ -819,15 +5452,49 @@ int main(int argc, char* argv[])
             free(name);
         }
 
-        // Set encodings + initial update request
-        if (send(sockfd, ZLIB_ENCODING, sizeof(ZLIB_ENCODING), 0) < 0) {
-            perror("send ZLIB_ENCODING");
+        // Pixel format, encodings + initial update request
+        if (send_set_pixel_format(sockfd, &canvas.format) != 0) {
+            perror("send SET_PIXEL_FORMAT");
+            canvas_free(&canvas);
+            close(sockfd);
+            reconnect_backoff(&reconnectFailures);
+            continue;
+        }
+        EncodingController controller;
+        encoding_controller_init(&controller);
+        if (send_set_encodings(sockfd, controller.compress, controller.quality) != 0) {
+            perror("send SET_ENCODINGS");
+            canvas_free(&canvas);
             close(sockfd);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
-        if (send(sockfd, FRAMEBUFFER_UPDATE_REQUEST, sizeof(FRAMEBUFFER_UPDATE_REQUEST), 0) < 0) {
+
+        // opt-in (serverScale), only UltraVNC-style servers know SetScale;
+        // without DesktopSize the server would scale behind our back
+        int scale = scaleRejected ? 0 : server_scale_for(canvas.width, canvas.height);
+        int hasDesktopSize = 0;
+        for (int i = 0; i < preferredEncodingCount; i++) {
+            if (preferredEncodings[i] == ENCODING_DESKTOP_SIZE) hasDesktopSize = 1;
+        }
+        if (scale > 1 && hasDesktopSize) {
+            printf("Asking the server to scale by 1/%d\n", scale);
+            if (send_set_scale(sockfd, scale) != 0) {
+                perror("send SET_SCALE");
+                canvas_free(&canvas);
+                close(sockfd);
+                reconnect_backoff(&reconnectFailures);
+                continue;
+            }
+        } else {
+            scale = 0;
+        }
+        UpdateFlow flow;
+        if (request_full_update(sockfd, &canvas, &flow) != 0 || top_up_requests(sockfd, &canvas, &flow) != 0) {
             perror("send initial FRAMEBUFFER_UPDATE_REQUEST");
+            canvas_free(&canvas);
             close(sockfd);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
 
@@ -839,20 +5506,54 @@ int main(int argc, char* argv[])
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        TextureUploader uploader;
+        int textureWidth = 0, textureHeight = 0; // allocated by the first frame
 
-        // ---- zlib stream (persistent across frames) ----
-        z_stream strm;
-        memset(&strm, 0, sizeof(strm));
-        if (inflateInit(&strm) != Z_OK) {
+        // ---- zlib streams (persistent across frames) ----
+        RfbDecoders decoders;
+        if (decoders_init(&decoders) != 0) {
             fprintf(stderr, "inflateInit failed\n");
+            canvas_free(&canvas);
+            close(sockfd);
+            glDeleteTextures(1, &textureID);
+            reconnect_backoff(&reconnectFailures);
+            continue;
+        }
+        RfbParser parser;
+        rfb_parser_init(&parser);
+        FrameHandoff handoff;
+        if (frame_handoff_init(&handoff, &canvas) != 0) {
+            fprintf(stderr, "Out of memory for frame buffers\n");
+            rfb_parser_free(&parser);
+            decoders_free(&decoders);
+            canvas_free(&canvas);
             close(sockfd);
             glDeleteTextures(1, &textureID);
+            reconnect_backoff(&reconnectFailures);
             continue;
         }
 
-        int framebufferWidthInt = 0;
-        int framebufferHeightInt = 0;
-        int finalHeight = 0;
+        // from here on the socket and the canvas belong to the network thread
+        NetworkSession session;
+        session.sockfd = sockfd;
+        session.canvas = &canvas;
+        session.decoders = &decoders;
+        session.parser = &parser;
+        session.flow = &flow;
+        session.controller = &controller;
+        session.handoff = &handoff;
+        session.frames = 0;
+        if (pthread_create(&session.thread, NULL, network_thread_main, &session) != 0) {
+            perror("pthread_create");
+            frame_handoff_free(&handoff);
+            rfb_parser_free(&parser);
+            decoders_free(&decoders);
+            canvas_free(&canvas);
+            close(sockfd);
+            glDeleteTextures(1, &textureID);
+            reconnect_backoff(&reconnectFailures);
+            continue;
+        }
 
         // FPS
         int frameCount = 0;
@@ -860,28 +5561,22 @@ int main(int argc, char* argv[])
         uint64_t lastFpsUs = now_us();
 
         // ---- render loop ----
-        execute_initial_commands();
-
+        int shown = 0;
         for (;;) {
+            // sleeps until the network thread publishes a frame or ends
+            while (sem_wait(&handoff.ready) != 0 && errno == EINTR) {
+            }
+            Canvas* frame = frame_handoff_take(&handoff);
+            if (!frame) {
+                if (atomic_load_int(&handoff.done)) break;
+                continue;
+            }
             uint64_t frameStartUs = now_us();
-            FrameTimings timings;
-
-            char* framebufferUpdate = parseFramebufferUpdate_pipelined(
-                sockfd,
-                &framebufferWidthInt,
-                &framebufferHeightInt,
-                &strm,
-                &finalHeight,
-                &timings);
-
-            if (!framebufferUpdate) {
-                perror("parseFramebufferUpdate_pipelined");
-                close(sockfd);
-                break;
+            if (!shown) {
+                display_request(DISPLAY_VNC, 0); // only now there is something to show
+                shown = 1;
             }
 
-            // NOTE: no send() here anymore; it's pipelined inside the parser.
-
             // FPS update
             frameCount++;
             uint64_t nowUs = now_us();
@@ -894,18 +5589,26 @@ int main(int argc, char* argv[])
 
             // Render
             glClear(GL_COLOR_BUFFER_BIT);
-            glUseProgram(programObject);
 
-            uint64_t texStartUs = now_us();
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, framebufferWidthInt, finalHeight,
-                         0, GL_RGBA, GL_UNSIGNED_BYTE, framebufferUpdate);
-            uint64_t texEndUs = now_us();
-            timings.texture_upload_ms = us_to_ms(texEndUs - texStartUs);
+            if (frame->width != textureWidth || frame->height != textureHeight) {
+                texture_alloc(frame, &uploader);
+                textureWidth = frame->width;
+                textureHeight = frame->height;
+            }
+            uint64_t uploadStartUs = now_us();
+            texture_upload_dirty(frame, &uploader);
+            frame_handoff_uploaded(&handoff, now_us() - uploadStartUs);
+
+            // the YCbCr variant only once a JPEG rect has arrived
+            GLuint program = programObject;
+            if (frame->bytesPerPixel == 1) program = programObjectPalette;
+            else if (frame->planes) program = programObjectYCbCr;
+            glUseProgram(program);
 
-            GLint positionAttribute = glGetAttribLocation(programObject, "position");
-            GLint texCoordAttrib    = glGetAttribLocation(programObject, "texCoord");
+            GLint positionAttribute = glGetAttribLocation(program, "position");
+            GLint texCoordAttrib    = glGetAttribLocation(program, "texCoord");
 
-            if (framebufferWidthInt > finalHeight) {
+            if (frame->width > frame->height) {
                 glVertexAttribPointer(positionAttribute, 3, GL_FLOAT, GL_FALSE, 0, landscapeVertices);
                 glVertexAttribPointer(texCoordAttrib,    2, GL_FLOAT, GL_FALSE, 0, landscapeTexCoords);
             } else {
@@ -921,28 +5624,25 @@ int main(int argc, char* argv[])
             glDisableVertexAttribArray(positionAttribute);
             glDisableVertexAttribArray(texCoordAttrib);
 
-            // Optional on-screen stats
-            //timings.total_frame_ms = us_to_ms(now_us() - frameStartUs);
-            //char overlay[256];
-            //snprintf(overlay, sizeof(overlay),
-            //         "FPS %.1f\nFrame %.2fms\nRecv %.2fms\nInflate %.2fms\nParse %.2fms\nGPU %.2fms",
-            //         fps,
-            //         timings.total_frame_ms,
-            //         timings.recv_ms,
-            //         timings.inflate_ms,
-            //         timings.parse_ms,
-            //         timings.texture_upload_ms);
-            //print_string(-320, 220, overlay, 1, 1, 1, 64);
+            cursor_draw(frame->cursor, frame, &uploader, textureID);
 
             eglSwapBuffers(eglDisplay, eglSurface);
-
-            finalHeight = 0;
-            free(framebufferUpdate);
         }
 
-        inflateEnd(&strm);
+        pthread_join(session.thread, NULL);
+        close(sockfd);
+        if (scale && session.frames == 0) {
+            printf("Server closed before the first update, not sending SetScale again\n");
+            scaleRejected = 1;
+        }
+        frame_handoff_free(&handoff);
+        rfb_parser_free(&parser);
+        decoders_free(&decoders);
         glDeleteTextures(1, &textureID);
-        execute_final_commands();
+        texture_uploader_free(&uploader);
+        canvas_free(&canvas);
+        if (session.frames > 0) reconnectFailures = 0;
+        else reconnect_backoff(&reconnectFailures);
     }
 
     // Cleanup (never reached with the infinite loop, kept for completeness)
@@ -950,6 +5650,7 @@ int main(int argc, char* argv[])
     eglDestroySurface(eglDisplay, eglSurface);
     eglDestroyContext(eglDisplay, eglContext);
     eglTerminate(eglDisplay);
-    execute_final_commands();
+    display_request(DISPLAY_STOCK, 0);
+    display_shutdown();
     return EXIT_SUCCESS;
 }